@@ -1,10 +1,15 @@
+#define _POSIX_C_SOURCE 200809L
 #include "vbyte64.h"
+#include <fcntl.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
+#include <unistd.h>
 
 void sanity_check() {
   uint64_t data[] = {
@@ -109,6 +114,7 @@ void sanity_check_file() {
 
   size_t clen = 0;
   uint64_t *decompressed = vb64f_decompress_delta("fcomp.bin", &clen);
+  remove("fcomp.bin");
   if (!decompressed)
     exit(EXIT_FAILURE);
 
@@ -353,6 +359,959 @@ void test_encdec_delta_autofile(size_t n) {
   free(decompressed);
 }
 
+void test_encdec_mixed(size_t n) {
+  fprintf(stderr, "\n[%s]\n", __func__);
+  fprintf(stderr, "[gen ] n = %zu\n", n);
+
+  // values spanning every code 0..8, so that all the decoding paths are hit
+  uint64_t *au64 = malloc(n * sizeof au64[0]);
+  for (size_t i = 0; i < n; i++) {
+    uint64_t r = ((uint64_t)rand() << 32) | rand();
+    unsigned nbytes = rand() % 9;
+    au64[i] = nbytes ? r >> (64 - 8 * nbytes) : 0;
+  }
+
+  size_t errors = 0;
+  uint64_t *decompressed = malloc((n + 1) * sizeof decompressed[0]);
+  uint8_t *scratch = malloc(vb64_max_compressed_size(n) + sizeof(size_t));
+  // every length up to n, odd and even, including the all-zero tails
+  for (size_t m = 0; m <= n; m += 1 + m / 8) {
+    uint8_t *compressed = vb64_compress(au64, m, NULL);
+    vb64_decompress(compressed, decompressed, m);
+    for (size_t i = 0; i < m; i++)
+      errors += (au64[i] != decompressed[i]);
+    free(compressed);
+
+    compressed = vb64_compress_delta(au64, m, NULL);
+    vb64_decompress_delta(compressed, decompressed, m);
+    for (size_t i = 0; i < m; i++)
+      errors += (au64[i] != decompressed[i]);
+    free(compressed);
+
+    // single-pass output must match the two-pass one
+    size_t clen = 0, clen1p = 0;
+    compressed = vb64_compress_delta_wl(au64, m, &clen);
+    uint8_t *compressed1p = vb64_compress_delta_wl_onepass(au64, m, &clen1p, 1);
+    errors += clen != clen1p || memcmp(compressed, compressed1p, clen);
+
+    // caller provided buffers, rejected when one byte too small
+    size_t cap = vb64d_compressed_size(au64, m) + sizeof(size_t), dn = 0;
+    errors += vb64_compress_delta_wl_into(au64, m, scratch, cap - 1) != 0;
+    errors += vb64_compress_delta_wl_into(au64, m, scratch, cap) != clen;
+    errors += memcmp(compressed, scratch, clen) != 0;
+    errors += vb64_decompress_delta_wl_into(scratch, &dn, decompressed, m) !=
+              decompressed;
+    for (size_t i = 0; i < dn; i++)
+      errors += (au64[i] != decompressed[i]);
+    free(compressed);
+    free(compressed1p);
+  }
+  fprintf(stderr, "[decode] errors = %zu\n", errors);
+
+  free(au64);
+  free(decompressed);
+  free(scratch);
+}
+
+void test_arena(size_t n) {
+  fprintf(stderr, "\n[%s]\n", __func__);
+  fprintf(stderr, "[gen ] n = %zu\n", n);
+
+  uint64_t au64[64];
+  for (size_t i = 0; i < 64; i++)
+    au64[i] = i * i * 1000;
+
+  struct vb64_arena arena;
+  vb64_arena_init(&arena, 1 << 16);
+  struct vb64_allocator alloc = vb64_arena_allocator(&arena);
+  vb64_set_allocator(&alloc);
+
+  // many small arrays in one arena, released at once
+  size_t errors = 0;
+  for (int round = 0; round < 2; round++) {
+    for (size_t k = 0; k < n; k++) {
+      size_t m = k % 64, clen = 0, dn = 0;
+      uint8_t *compressed = vb64_compress_delta_wl_onepass(au64, m, &clen, 1);
+      uint64_t *decompressed = vb64_decompress_delta_wl(compressed, &dn);
+      errors += dn != m;
+      for (size_t i = 0; i < dn; i++)
+        errors += (au64[i] != decompressed[i]);
+    }
+    vb64_arena_reset(&arena);
+  }
+  vb64_set_allocator(NULL);
+  vb64_arena_destroy(&arena);
+  fprintf(stderr, "[decode] errors = %zu\n", errors);
+}
+
+void test_blocked(size_t n) {
+  fprintf(stderr, "\n[%s]\n", __func__);
+  fprintf(stderr, "[gen ] n = %zu\n", n);
+
+  // sorted, with gaps of every size
+  uint64_t *au64 = malloc(n * sizeof au64[0]);
+  for (size_t i = 0, prev = 0; i < n; i++) {
+    unsigned nbytes = rand() % 5;
+    au64[i] = prev += nbytes ? (uint64_t)rand() >> (32 - 8 * nbytes) : 0;
+  }
+
+  size_t errors = 0, dn = 0;
+  uint64_t *range = malloc(n * sizeof range[0]);
+  for (int delta = 0; delta < 2; delta++) {
+    uint8_t *compressed = delta ? vb64b_compress_delta(au64, n, NULL)
+                                : vb64b_compress(au64, n, NULL);
+    uint64_t *decompressed = vb64b_decompress(compressed, &dn);
+    errors += dn != n;
+    for (size_t i = 0; i < n; i++)
+      errors += (au64[i] != decompressed[i]);
+
+    for (size_t k = 0; k < 1000; k++) {
+      size_t i = rand() % n, lo = rand() % n, hi = lo + rand() % 300;
+      errors += vb64b_get(compressed, i) != au64[i];
+      size_t m = vb64b_decode_range(compressed, lo, hi, range);
+      errors += m != (hi < n ? hi : n) - lo;
+      for (size_t j = 0; j < m; j++)
+        errors += range[j] != au64[lo + j];
+    }
+    if (delta) {
+      // lower bound of present, absent and out of range values
+      for (size_t k = 0; k < 1000; k++) {
+        uint64_t x = au64[rand() % n] + rand() % 3 - 1, val = 0;
+        size_t i = 0, j = vb64b_lower_bound(compressed, x, &val);
+        while (i < n && au64[i] < x)
+          i++;
+        errors += i != j || (j < n && val != au64[j]);
+      }
+      errors += vb64b_lower_bound(compressed, au64[n - 1] + 1, NULL) != n;
+      errors += vb64b_lower_bound(compressed, 0, NULL) != 0;
+    } else {
+      // the bases of a plain stream cannot be searched
+      errors += vb64b_lower_bound(compressed, au64[n / 2], NULL) != n;
+    }
+    free(compressed);
+    free(decompressed);
+  }
+  uint8_t *compressed = vb64b_compress_adaptive(au64, n, NULL);
+  errors += vb64b_lower_bound(compressed, au64[n / 2], NULL) != n;
+  free(compressed);
+  fprintf(stderr, "[decode] errors = %zu\n", errors);
+
+  free(au64);
+  free(range);
+}
+
+void test_adaptive(size_t n) {
+  fprintf(stderr, "\n[%s]\n", __func__);
+  fprintf(stderr, "[gen ] n = %zu\n", n);
+
+  // sorted runs, followed by unsorted values close to each other, constants
+  // or random values
+  uint64_t *au64 = malloc(n * sizeof au64[0]);
+  for (size_t i = 0, prev = 0; i < n; i++) {
+    switch (i / 1000 % 4) {
+    case 3:
+      au64[i] = (i / 4000 % 4) * ((uint64_t)rand() << 32 | rand());
+      break;
+    case 2:
+      au64[i] = prev + rand() % 1000;
+      break;
+    default:
+      au64[i] = prev += rand() % 100;
+    }
+  }
+
+  size_t errors = 0, dn = 0, clen, dlen, plen;
+  free(vb64b_compress_delta(au64, n, &dlen));
+  free(vb64b_compress(au64, n, &plen));
+  uint8_t *compressed = vb64b_compress_adaptive(au64, n, &clen);
+  fprintf(stderr, "[size] plain = %zu delta = %zu adaptive = %zu\n", plen,
+          dlen, clen);
+  errors += clen > dlen || clen > plen;
+
+  uint64_t *decompressed = vb64b_decompress(compressed, &dn);
+  errors += dn != n;
+  for (size_t i = 0; i < n; i++)
+    errors += (au64[i] != decompressed[i]);
+
+  uint64_t *range = malloc(n * sizeof range[0]);
+  for (size_t k = 0; k < 1000; k++) {
+    size_t i = rand() % n, lo = rand() % n, hi = lo + rand() % 300;
+    errors += vb64b_get(compressed, i) != au64[i];
+    size_t m = vb64b_decode_range(compressed, lo, hi, range);
+    errors += m != (hi < n ? hi : n) - lo;
+    for (size_t j = 0; j < m; j++)
+      errors += range[j] != au64[lo + j];
+  }
+  fprintf(stderr, "[decode] errors = %zu\n", errors);
+
+  free(compressed);
+  free(decompressed);
+  free(au64);
+  free(range);
+}
+
+void test_setops(size_t n) {
+  fprintf(stderr, "\n[%s]\n", __func__);
+  fprintf(stderr, "[gen ] n = %zu\n", n);
+
+  // a dense list and a sparse one, sharing part of their values
+  size_t na = n, nb = n / 10;
+  uint64_t *a = malloc(na * sizeof a[0]), *b = malloc(nb * sizeof b[0]);
+  for (size_t i = 0, prev = 0; i < na; i++)
+    a[i] = prev += rand() % 4;
+  for (size_t i = 0, prev = 0; i < nb; i++)
+    b[i] = prev += rand() % 40;
+
+  // reference results on the plain arrays
+  uint64_t *ei = malloc(nb * sizeof ei[0]);
+  uint64_t *eu = malloc((na + nb) * sizeof eu[0]);
+  size_t ni = 0, nu = 0, i = 0, j = 0;
+  while (i < na && j < nb) {
+    if (a[i] == b[j]) {
+      ei[ni++] = eu[nu++] = a[i++];
+      j++;
+    } else {
+      eu[nu++] = a[i] < b[j] ? a[i++] : b[j++];
+    }
+  }
+  while (i < na)
+    eu[nu++] = a[i++];
+  while (j < nb)
+    eu[nu++] = b[j++];
+
+  uint8_t *ca = vb64b_compress_delta(a, na, NULL);
+  uint8_t *cb = vb64b_compress_delta(b, nb, NULL);
+  uint64_t *out = malloc((na + nb) * sizeof out[0]);
+  size_t errors = 0, m = 0;
+
+  m = vb64b_intersect(ca, cb, out);
+  errors += m != ni;
+  for (size_t k = 0; k < m && k < ni; k++)
+    errors += out[k] != ei[k];
+  m = vb64b_union(cb, ca, out);
+  errors += m != nu;
+  for (size_t k = 0; k < m && k < nu; k++)
+    errors += out[k] != eu[k];
+
+  uint8_t *ci = vb64b_intersect_delta(cb, ca, NULL);
+  uint8_t *cu = vb64b_union_delta(ca, cb, NULL);
+  uint64_t *di = vb64b_decompress(ci, &m);
+  errors += m != ni;
+  for (size_t k = 0; k < m && k < ni; k++)
+    errors += di[k] != ei[k];
+  uint64_t *du = vb64b_decompress(cu, &m);
+  errors += m != nu;
+  for (size_t k = 0; k < m && k < nu; k++)
+    errors += du[k] != eu[k];
+
+  // plain and adaptive streams have no searchable bases, mixed with delta
+  uint8_t *pa = vb64b_compress(a, na, NULL);
+  uint8_t *pb = vb64b_compress_adaptive(b, nb, NULL);
+  const uint8_t *pairs[3][2] = {{pa, pb}, {ca, pb}, {pa, cb}};
+  for (int p = 0; p < 3; p++) {
+    m = vb64b_intersect(pairs[p][0], pairs[p][1], out);
+    errors += m != ni;
+    for (size_t k = 0; k < m && k < ni; k++)
+      errors += out[k] != ei[k];
+    m = vb64b_intersect(pairs[p][1], pairs[p][0], out);
+    errors += m != ni;
+    for (size_t k = 0; k < m && k < ni; k++)
+      errors += out[k] != ei[k];
+  }
+  free(pa);
+  free(pb);
+  fprintf(stderr, "[setop] intersection = %zu union = %zu\n", ni, nu);
+  fprintf(stderr, "[setop] errors = %zu\n", errors);
+
+  free(a);
+  free(b);
+  free(ei);
+  free(eu);
+  free(ca);
+  free(cb);
+  free(ci);
+  free(cu);
+  free(di);
+  free(du);
+  free(out);
+}
+
+void test_mt(size_t n) {
+  fprintf(stderr, "\n[%s]\n", __func__);
+  fprintf(stderr, "[gen ] n = %zu\n", n);
+
+  uint64_t *au64 = malloc(n * sizeof au64[0]);
+  for (size_t i = 0, prev = 0; i < n; i++) {
+    unsigned nbytes = rand() % 9;
+    au64[i] = prev += nbytes ? (uint64_t)rand() >> (32 - 4 * nbytes) : 0;
+  }
+
+  size_t errors = 0, clen = 0, clen_mt = 0, dn = 0;
+  uint8_t *compressed = vb64_compress_delta_wl(au64, n, &clen);
+  for (int nthreads = 1; nthreads <= 4; nthreads++) {
+    clock_t t0 = clock();
+    uint8_t *compressed_mt =
+        vb64_compress_delta_wl_mt(au64, n, &clen_mt, nthreads);
+    errors += clen != clen_mt || memcmp(compressed, compressed_mt, clen);
+    uint64_t *decompressed =
+        vb64_decompress_delta_wl_mt(compressed_mt, &dn, nthreads);
+    errors += dn != n;
+    for (size_t i = 0; i < n; i++)
+      errors += (au64[i] != decompressed[i]);
+    fprintf(stderr, "[mt] threads = %d: %5ld s\n", nthreads,
+            (clock() - t0) / CLOCKS_PER_SEC);
+    free(compressed_mt);
+    free(decompressed);
+  }
+  fprintf(stderr, "[decode] errors = %zu\n", errors);
+
+  free(au64);
+  free(compressed);
+}
+
+void test_encdec_delta_mapfile(size_t n) {
+  fprintf(stderr, "\n[%s]\n", __func__);
+  fprintf(stderr, "[gen ] n = %zu\n", n);
+
+  uint64_t *au64 = malloc(n * sizeof au64[0]);
+  for (size_t i = 0, prev = 0; i < n; i++)
+    au64[i] = prev += rand() % 1000;
+
+  size_t errors = 0;
+  if (!vb64f_compress_delta(au64, n, "compressed.bin"))
+    exit(EXIT_FAILURE);
+
+  struct vb64f_mapping m;
+  if (vb64f_map("compressed.bin", &m) != 0)
+    exit(EXIT_FAILURE);
+  fprintf(stderr, "[decode] n = %zu\n", m.n);
+  uint64_t *decompressed = malloc(m.n * sizeof decompressed[0]);
+  vb64f_map_decompress_delta(&m, decompressed);
+  errors += m.n != n;
+  for (size_t i = 0; i < n; i++)
+    errors += (au64[i] != decompressed[i]);
+  vb64f_unmap(&m);
+
+  // a file cut inside its data is rejected instead of read past its end
+  struct stat sb;
+  if (stat("compressed.bin", &sb) != 0 ||
+      truncate("compressed.bin", sb.st_size - 4) != 0)
+    exit(EXIT_FAILURE);
+  errors += vb64f_map("compressed.bin", &m) != -1;
+  remove("compressed.bin");
+  fprintf(stderr, "[decode] errors = %zu\n", errors);
+
+  free(au64);
+  free(decompressed);
+}
+
+struct membuf {
+  uint8_t *buf;
+  size_t len, cap, pos;
+};
+
+size_t membuf_write(const void *buf, size_t len, void *ud) {
+  struct membuf *m = ud;
+  if (m->len + len > m->cap) {
+    m->cap = 2 * (m->len + len);
+    m->buf = realloc(m->buf, m->cap);
+  }
+  memcpy(m->buf + m->len, buf, len);
+  m->len += len;
+  return len;
+}
+
+size_t membuf_read(void *buf, size_t len, void *ud) {
+  struct membuf *m = ud;
+  if (len > m->len - m->pos)
+    len = m->len - m->pos;
+  memcpy(buf, m->buf + m->pos, len);
+  m->pos += len;
+  return len;
+}
+
+void test_stream(size_t n) {
+  fprintf(stderr, "\n[%s]\n", __func__);
+  fprintf(stderr, "[gen ] n = %zu\n", n);
+
+  uint64_t *au64 = malloc(n * sizeof au64[0]);
+  for (size_t i = 0, prev = 0; i < n; i++)
+    au64[i] = prev += rand() % 100000;
+
+  size_t errors = 0;
+  uint64_t *decompressed = malloc(n * sizeof decompressed[0]);
+  for (int delta = 0; delta < 2; delta++) {
+    // pushed and pulled in batches of random, often odd, sizes
+    struct membuf mb = {NULL, 0, 0, 0};
+    struct vb64s_encoder e;
+    vb64s_encoder_init(&e, delta, membuf_write, &mb);
+    for (size_t i = 0, m; i < n; i += m) {
+      m = rand() % 3000;
+      m = m < n - i ? m : n - i;
+      errors += vb64s_push(&e, au64 + i, m) != 0;
+    }
+    errors += vb64s_finish(&e) != 0;
+
+    struct vb64s_decoder d;
+    vb64s_decoder_init(&d, delta, membuf_read, &mb);
+    size_t dn = 0, m;
+    while ((m = vb64s_next(&d, decompressed + dn, 1 + rand() % 5000)) > 0)
+      dn += m;
+    errors += dn != n || d.err;
+    for (size_t i = 0; i < n && i < dn; i++)
+      errors += (au64[i] != decompressed[i]);
+    vb64s_decoder_free(&d);
+    fprintf(stderr, "[stream] bytes = %zu\n", mb.len);
+    free(mb.buf);
+  }
+  fprintf(stderr, "[decode] errors = %zu\n", errors);
+
+  free(au64);
+  free(decompressed);
+}
+
+void test_segmentfile(size_t n) {
+  fprintf(stderr, "\n[%s]\n", __func__);
+  fprintf(stderr, "[gen ] n = %zu\n", n);
+
+  uint64_t *au64 = malloc(n * sizeof au64[0]);
+  for (size_t i = 0, prev = 0; i < n; i++)
+    au64[i] = prev += rand() % 100000;
+
+  // arrays of growing length appended to one file, alternating the modes
+  int fd = open("segment.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    exit(EXIT_FAILURE);
+  off_t off = 0;
+  for (size_t k = 0, m = 1; m <= n; k++, m *= 3)
+    off += k & 1 ? vb64fd_compress(au64, m, fd, off)
+                 : vb64fd_compress_delta(au64, m, fd, off);
+  fprintf(stderr, "[encode] bytes = %ld\n", (long)off);
+
+  size_t errors = 0, dn = 0, clen = 0;
+  off = 0;
+  for (size_t k = 0, m = 1; m <= n; k++, m *= 3) {
+    uint64_t *decompressed = k & 1
+                                 ? vb64fd_decompress(fd, off, &dn, &clen)
+                                 : vb64fd_decompress_delta(fd, off, &dn, &clen);
+    errors += !decompressed || dn != m;
+    for (size_t i = 0; decompressed && i < m; i++)
+      errors += (au64[i] != decompressed[i]);
+    off += clen;
+    free(decompressed);
+  }
+  close(fd);
+  remove("segment.bin");
+
+  if (!vb64f_compress(au64, n, "compressed.bin"))
+    exit(EXIT_FAILURE);
+  uint64_t *decompressed = vb64f_decompress("compressed.bin", &dn);
+  remove("compressed.bin");
+  errors += dn != n;
+  for (size_t i = 0; i < n; i++)
+    errors += (au64[i] != decompressed[i]);
+  fprintf(stderr, "[decode] errors = %zu\n", errors);
+
+  free(au64);
+  free(decompressed);
+}
+
+void test_container(size_t n) {
+  fprintf(stderr, "\n[%s]\n", __func__);
+  fprintf(stderr, "[gen ] n = %zu\n", n);
+
+  uint64_t *au64 = malloc(n * sizeof au64[0]);
+  for (size_t i = 0, prev = 0; i < n; i++)
+    au64[i] = prev += rand() % 100000;
+
+  // the prefixes of `au64` of length `id * id`, added in reverse id order
+  size_t count = 0;
+  while (count * count <= n)
+    count++;
+  struct vb64c_writer w;
+  if (vb64c_create(&w, "container.bin") != 0)
+    exit(EXIT_FAILURE);
+  for (size_t id = count; id-- > 0;)
+    vb64c_add(&w, id, au64, id * id, id % 3);
+  if (vb64c_finish(&w) != 0)
+    exit(EXIT_FAILURE);
+
+  size_t errors = 0, dn = 0;
+  struct vb64c_reader r;
+  if (vb64c_open("container.bin", &r) != 0)
+    exit(EXIT_FAILURE);
+  fprintf(stderr, "[decode] arrays = %zu bytes = %zu\n", r.count, r.size);
+  errors += r.count != count || vb64c_find(&r, count) != NULL;
+  for (size_t id = 0; id < count; id++) {
+    const struct vb64c_entry *e = vb64c_find(&r, id);
+    uint64_t *decompressed = vb64c_decompress(&r, id, &dn);
+    errors += !e || !decompressed || dn != id * id;
+    errors += dn && (e->min != au64[0] || e->max != au64[dn - 1]);
+    for (size_t i = 0; decompressed && i < dn; i++)
+      errors += (au64[i] != decompressed[i]);
+    free(decompressed);
+  }
+
+  // an entry whose size is short of the data of its keys is rejected when
+  // decoded, the others still decode
+  const struct vb64c_entry *last = vb64c_find(&r, count - 1);
+  off_t at = (const uint8_t *)last - r.base +
+             offsetof(struct vb64c_entry, size);
+  uint64_t size = last->size - 8;
+  vb64c_close(&r);
+  int fd = open("container.bin", O_WRONLY);
+  if (fd < 0 || pwrite(fd, &size, sizeof(size), at) != sizeof(size))
+    exit(EXIT_FAILURE);
+  close(fd);
+  if (vb64c_open("container.bin", &r) != 0)
+    exit(EXIT_FAILURE);
+  uint64_t *decompressed = vb64c_decompress(&r, count - 1, &dn);
+  errors += decompressed != NULL;
+  free(decompressed);
+  decompressed = vb64c_decompress(&r, count - 2, &dn);
+  errors += !decompressed || dn != (count - 2) * (count - 2);
+  free(decompressed);
+  vb64c_close(&r);
+  remove("container.bin");
+  fprintf(stderr, "[decode] errors = %zu\n", errors);
+
+  free(au64);
+}
+
+struct load_check {
+  const uint64_t *data;
+  size_t count, errors;
+};
+
+void load_done(size_t i, uint64_t *v, size_t n, void *ud) {
+  struct load_check *c = ud;
+  // file `i` holds the first `i * 1000` values, the last one is missing
+  if (i == c->count - 1) {
+    c->errors += v != NULL;
+    return;
+  }
+  c->errors += !v || n != i * 1000;
+  for (size_t j = 0; v && j < n; j++)
+    c->errors += (c->data[j] != v[j]);
+  free(v);
+}
+
+void test_load(size_t n) {
+  fprintf(stderr, "\n[%s]\n", __func__);
+  fprintf(stderr, "[gen ] n = %zu\n", n);
+
+  uint64_t *au64 = malloc(n * sizeof au64[0]);
+  for (size_t i = 0, prev = 0; i < n; i++)
+    au64[i] = prev += rand() % 1000;
+
+  size_t count = n / 1000 + 1;
+  char(*names)[32] = malloc(count * sizeof names[0]);
+  const char **fpaths = malloc(count * sizeof fpaths[0]);
+  for (size_t i = 0; i < count; i++) {
+    snprintf(names[i], sizeof names[i], "load%zu.bin", i);
+    fpaths[i] = names[i];
+    if (i < count - 1 && !vb64f_compress_delta(au64, i * 1000, fpaths[i]))
+      exit(EXIT_FAILURE);
+  }
+  remove(fpaths[count - 1]);
+
+  size_t errors = 0;
+  for (int pool = 0; pool < 2; pool++) {
+    if (pool)
+      setenv("VBYTE64_NO_URING", "1", 1);
+    struct load_check c = {au64, count, 0};
+    errors += vb64f_load_delta(fpaths, count, load_done, &c) != -1;
+    errors += c.errors;
+    fprintf(stderr, "[load] %s errors = %zu\n", pool ? "pool" : "uring",
+            c.errors);
+  }
+  unsetenv("VBYTE64_NO_URING");
+  for (size_t i = 0; i < count - 1; i++)
+    remove(fpaths[i]);
+  fprintf(stderr, "[decode] errors = %zu\n", errors);
+
+  free(au64);
+  free(names);
+  free(fpaths);
+}
+
+void test_grouped(size_t n) {
+  fprintf(stderr, "\n[%s]\n", __func__);
+  fprintf(stderr, "[gen ] n = %zu\n", n);
+
+  // mostly one byte deltas, with a few larger jumps
+  uint64_t *au64 = malloc(n * sizeof au64[0]);
+  for (size_t i = 0, prev = 0; i < n; i++)
+    au64[i] = prev += i % 64 ? rand() % 200 : rand() % 100000000;
+
+  const uint8_t tables[][4] = {{1, 2, 4, 8}, {0, 1, 2, 8}, {1, 3, 5, 8}};
+  size_t errors = 0, clen, dn;
+  fprintf(stderr, "[size] nibble keys = %zu\n", vb64d_compressed_size(au64, n));
+  for (size_t t = 0; t < sizeof tables / sizeof tables[0]; t++) {
+    fprintf(stderr, "[size] {%d,%d,%d,%d} = %zu\n", tables[t][0],
+            tables[t][1], tables[t][2], tables[t][3],
+            vb64gd_compressed_size(au64, n, tables[t]));
+    // every length of the last key byte, then the full array
+    for (size_t m = 0; m <= n; m = m < 9 ? m + 1 : n + (m == n)) {
+      uint8_t *compressed = vb64g_compress_delta(au64, m, tables[t], &clen);
+      errors += clen + VBYTE64_PADDING !=
+                vb64gd_compressed_size(au64, m, tables[t]);
+      uint64_t *decompressed = vb64g_decompress_delta(compressed, &dn);
+      errors += dn != m;
+      for (size_t i = 0; i < m; i++)
+        errors += (au64[i] != decompressed[i]);
+      free(compressed);
+      free(decompressed);
+
+      compressed = vb64g_compress(au64, m, tables[t], NULL);
+      decompressed = vb64g_decompress(compressed, &dn);
+      errors += dn != m;
+      for (size_t i = 0; i < m; i++)
+        errors += (au64[i] != decompressed[i]);
+      free(compressed);
+      free(decompressed);
+    }
+  }
+  const uint8_t bad[4] = {1, 2, 4, 7};
+  errors += vb64g_compress(au64, n, bad, &clen) != NULL;
+  errors += vb64g_compressed_size(au64, n, bad) != 0;
+  fprintf(stderr, "[decode] errors = %zu\n", errors);
+
+  free(au64);
+}
+
+void test_zdelta(size_t n) {
+  fprintf(stderr, "\n[%s]\n", __func__);
+  fprintf(stderr, "[gen ] n = %zu\n", n);
+
+  // mostly increasing, with small steps back and a few large jumps both ways
+  uint64_t *au64 = malloc(n * sizeof au64[0]);
+  for (size_t i = 0, prev = 1ULL << 40; i < n; i++)
+    au64[i] = prev += i % 1000 ? rand() % 200 - 50
+                               : (rand() % 2 ? 1 : -1) * (rand() % 1000000);
+
+  size_t errors = 0, clen = 0, dn = 0;
+  fprintf(stderr, "[size] delta = %zu zdelta = %zu\n",
+          vb64d_compressed_size(au64, n), vb64zd_compressed_size(au64, n));
+  errors += vb64zd_compressed_size(au64, n) >= vb64d_compressed_size(au64, n);
+
+  // every length of the scalar tail, then the full array
+  uint64_t *decompressed = malloc(n * sizeof decompressed[0]);
+  for (size_t m = 0; m <= n; m = m < 33 ? m + 1 : n + (m == n)) {
+    uint8_t *compressed = vb64_compress_zdelta(au64, m, &clen);
+    errors += clen + VBYTE64_PADDING != vb64zd_compressed_size(au64, m);
+    vb64_decompress_zdelta(compressed, decompressed, m);
+    for (size_t i = 0; i < m; i++)
+      errors += (au64[i] != decompressed[i]);
+    free(compressed);
+  }
+  free(decompressed);
+
+  uint8_t *compressed = vb64_compress_zdelta_wl(au64, n, &clen);
+  decompressed = vb64_decompress_zdelta_wl(compressed, &dn);
+  errors += dn != n;
+  for (size_t i = 0; i < n; i++)
+    errors += (au64[i] != decompressed[i]);
+  free(compressed);
+  free(decompressed);
+
+  if (!vb64f_compress_zdelta(au64, n, "compressed.bin"))
+    exit(EXIT_FAILURE);
+  decompressed = vb64f_decompress_zdelta("compressed.bin", &dn);
+  remove("compressed.bin");
+  errors += dn != n;
+  for (size_t i = 0; i < n; i++)
+    errors += (au64[i] != decompressed[i]);
+  fprintf(stderr, "[decode] errors = %zu\n", errors);
+
+  free(au64);
+  free(decompressed);
+}
+
+void test_extended(size_t n) {
+  fprintf(stderr, "\n[%s]\n", __func__);
+  fprintf(stderr, "[gen ] n = %zu\n", n);
+
+  // sorted ids with repeats, constant strides and random gaps
+  uint64_t *au64 = malloc(n * sizeof au64[0]);
+  for (size_t i = 0, prev = 0; i < n;) {
+    size_t r = 1 + rand() % (rand() % 4 ? 3 : 300);
+    uint64_t step = rand() % 3 ? 0 : rand() % 3 ? 1 + rand() % 1000 : 0;
+    prev += rand() % 100000;
+    for (size_t k = 0; k < r && i < n; k++, i++)
+      au64[i] = prev += step;
+  }
+
+  size_t errors = 0, clen = 0, dn = 0;
+  uint8_t *compressed = vb64x_compress_delta(au64, n, &clen);
+  fprintf(stderr, "[size] delta = %zu extended = %zu\n",
+          vb64d_compressed_size(au64, n) - VBYTE64_PADDING, clen);
+  errors += clen > vb64d_compressed_size(au64, n) - VBYTE64_PADDING +
+                       3 * sizeof(size_t);
+
+  // every prefix of a short array, then the full one
+  uint64_t small[] = {0,  0,  0,  0,  0,  0,  0,  0,  0,  7,  14, 21,
+                      28, 35, 42, 49, 56, 63, 70, 70, 71, 71, 71, 71,
+                      71, 71, 71, 71, 71, 71, 75, 79, 83, 87, 91, 95,
+                      99, 103, 107, 111, 111, 112};
+  for (size_t m = 0; m <= sizeof small / sizeof small[0]; m++) {
+    uint8_t *scompressed = vb64x_compress_delta(small, m, NULL);
+    uint64_t *sdecompressed = vb64x_decompress_delta(scompressed, &dn);
+    errors += dn != m;
+    for (size_t i = 0; i < m; i++)
+      errors += (small[i] != sdecompressed[i]);
+    free(scompressed);
+    free(sdecompressed);
+  }
+  uint64_t *decompressed = vb64x_decompress_delta(compressed, &dn);
+  errors += dn != n;
+  for (size_t i = 0; i < n; i++)
+    errors += (au64[i] != decompressed[i]);
+  fprintf(stderr, "[decode] errors = %zu\n", errors);
+
+  free(compressed);
+  free(decompressed);
+  free(au64);
+}
+
+void test_width(size_t n) {
+  fprintf(stderr, "\n[%s]\n", __func__);
+  fprintf(stderr, "[gen ] n = %zu\n", n);
+
+  // sorted ids with gaps of every byte length, and their low 16 bits
+  uint32_t *au32 = malloc(n * sizeof au32[0]);
+  uint16_t *au16 = malloc(n * sizeof au16[0]);
+  for (size_t i = 0, prev = 0; i < n; i++) {
+    au32[i] = prev += rand() % 4 ? rand() % 300 : rand() % (1 << 20);
+    au16[i] = au32[i];
+  }
+  uint64_t *au64 = malloc(n * sizeof au64[0]);
+  for (size_t i = 0; i < n; i++)
+    au64[i] = au32[i];
+
+  size_t errors = 0, clen = 0, dn = 0;
+  fprintf(stderr, "[size] 64 delta = %zu 32 delta = %zu 16 delta = %zu\n",
+          vb64d_compressed_size(au64, n), vb32d_compressed_size(au32, n),
+          vb16d_compressed_size(au16, n));
+
+  // every length of the scalar tail, then the full array, in both modes
+  uint32_t *d32 = malloc(n * sizeof d32[0]);
+  uint16_t *d16 = malloc(n * sizeof d16[0]);
+  for (size_t m = 0; m <= n; m = m < 70 ? m + 1 : n + (m == n)) {
+    for (int delta = 0; delta < 2; delta++) {
+      uint8_t *c32 = delta ? vb32_compress_delta(au32, m, &clen)
+                           : vb32_compress(au32, m, &clen);
+      errors += clen + VBYTE64_PADDING !=
+                (delta ? vb32d_compressed_size(au32, m)
+                       : vb32_compressed_size(au32, m));
+      errors += clen + VBYTE64_PADDING > vb32_max_compressed_size(m);
+      if (delta)
+        vb32_decompress_delta(c32, d32, m);
+      else
+        vb32_decompress(c32, d32, m);
+      for (size_t i = 0; i < m; i++)
+        errors += (au32[i] != d32[i]);
+
+      uint8_t *c16 = delta ? vb16_compress_delta(au16, m, &clen)
+                           : vb16_compress(au16, m, &clen);
+      errors += clen + VBYTE64_PADDING !=
+                (delta ? vb16d_compressed_size(au16, m)
+                       : vb16_compressed_size(au16, m));
+      errors += clen + VBYTE64_PADDING > vb16_max_compressed_size(m);
+      if (delta)
+        vb16_decompress_delta(c16, d16, m);
+      else
+        vb16_decompress(c16, d16, m);
+      for (size_t i = 0; i < m; i++)
+        errors += (au16[i] != d16[i]);
+      free(c32);
+      free(c16);
+    }
+  }
+  free(d32);
+  free(d16);
+
+  uint8_t *c32 = vb32_compress_delta_wl(au32, n, &clen);
+  d32 = vb32_decompress_delta_wl(c32, &dn);
+  errors += dn != n;
+  for (size_t i = 0; i < n; i++)
+    errors += (au32[i] != d32[i]);
+  uint8_t *c16 = vb16_compress_wl(au16, n, &clen);
+  d16 = vb16_decompress_wl(c16, &dn);
+  errors += dn != n;
+  for (size_t i = 0; i < n; i++)
+    errors += (au16[i] != d16[i]);
+  fprintf(stderr, "[decode] errors = %zu\n", errors);
+
+  free(c32);
+  free(c16);
+  free(d32);
+  free(d16);
+  free(au64);
+  free(au32);
+  free(au16);
+}
+
+void test_small(void) {
+  fprintf(stderr, "\n[%s]\n", __func__);
+
+  // every length around `VBYTE64_SMALL`, values of every byte length
+  size_t errors = 0, n = VBYTE64_SMALL + 8;
+  uint64_t a64[VBYTE64_SMALL + 8], d64[VBYTE64_SMALL + 8];
+  uint32_t a32[VBYTE64_SMALL + 8], d32[VBYTE64_SMALL + 8];
+  uint16_t a16[VBYTE64_SMALL + 8], d16[VBYTE64_SMALL + 8];
+  for (size_t i = 0; i < n; i++) {
+    a64[i] = (i ? a64[i - 1] : 0) + ((uint64_t)rand() >> rand() % 31) *
+                                        (i % 7 ? 1 : 1ULL << rand() % 33);
+    a32[i] = a64[i];
+    a16[i] = a64[i];
+  }
+  for (size_t m = 0; m <= n; m++) {
+    for (int delta = 0; delta < 2; delta++) {
+      uint8_t *c64 = delta ? vb64_compress_delta(a64, m, NULL)
+                           : vb64_compress(a64, m, NULL);
+      uint8_t *c32 = delta ? vb32_compress_delta(a32, m, NULL)
+                           : vb32_compress(a32, m, NULL);
+      uint8_t *c16 = delta ? vb16_compress_delta(a16, m, NULL)
+                           : vb16_compress(a16, m, NULL);
+      if (delta) {
+        vb64_decompress_delta_small(c64, d64, m);
+        vb32_decompress_delta_small(c32, d32, m);
+        vb16_decompress_delta_small(c16, d16, m);
+      } else {
+        vb64_decompress_small(c64, d64, m);
+        vb32_decompress_small(c32, d32, m);
+        vb16_decompress_small(c16, d16, m);
+      }
+      for (size_t i = 0; i < m; i++)
+        errors += (a64[i] != d64[i]) + (a32[i] != d32[i]) + (a16[i] != d16[i]);
+      free(c64);
+      free(c32);
+      free(c16);
+    }
+  }
+  fprintf(stderr, "[decode] errors = %zu\n", errors);
+}
+
+void test_aggregate(size_t n) {
+  fprintf(stderr, "\n[%s]\n", __func__);
+  fprintf(stderr, "[gen ] n = %zu\n", n);
+
+  // values of every byte length, with a final run of zeros taking no data
+  // bytes so that the tail decoder sees more than one block
+  uint64_t *au64 = malloc(n * sizeof au64[0]);
+  uint64_t *su64 = malloc(n * sizeof su64[0]);
+  for (size_t i = 0; i < n; i++) {
+    au64[i] = i < n - 5000 ? ((uint64_t)rand() << 31 | rand()) >> rand() % 62
+                           : 0;
+    su64[i] = (i ? su64[i - 1] : 0) + (au64[i] >> rand() % 64);
+  }
+  uint64_t lo = 1ULL << 20, hi = 1ULL << 40;
+
+  // every length of the scalar tail, then the full array
+  size_t errors = 0, clen = 0;
+  for (size_t m = 0; m <= n; m = m < 33 ? m + 1 : n + (m == n)) {
+    for (int delta = 0; delta < 2; delta++) {
+      uint64_t *v = delta ? su64 : au64, sum = 0, min = UINT64_MAX, max = 0;
+      size_t count = 0;
+      for (size_t i = 0; i < m; i++) {
+        sum += v[i];
+        min = v[i] < min ? v[i] : min;
+        max = v[i] > max ? v[i] : max;
+        count += lo <= v[i] && v[i] < hi;
+      }
+
+      uint8_t *compressed =
+          delta ? vb64_compress_delta(v, m, &clen) : vb64_compress(v, m, &clen);
+      uint64_t rmin, rmax;
+      if (delta) {
+        errors += vb64_sum_delta(compressed, m) != sum;
+        vb64_minmax_delta(compressed, m, &rmin, &rmax);
+        errors += vb64_count_range_delta(compressed, m, lo, hi) != count;
+        errors += vb64_count_range_delta(compressed, m, hi, lo) != 0;
+      } else {
+        errors += vb64_sum(compressed, m) != sum;
+        vb64_minmax(compressed, m, &rmin, &rmax);
+        errors += vb64_count_range(compressed, m, lo, hi) != count;
+        errors += vb64_count_range(compressed, m, hi, lo) != 0;
+      }
+      errors += rmin != min || rmax != max;
+      free(compressed);
+    }
+  }
+  fprintf(stderr, "[decode] errors = %zu\n", errors);
+
+  free(au64);
+  free(su64);
+}
+
+void test_isa(size_t n) {
+  fprintf(stderr, "\n[%s]\n", __func__);
+  fprintf(stderr, "[gen ] n = %zu\n", n);
+
+  // values of every byte length, sorted and not
+  uint64_t *au64 = malloc(n * sizeof au64[0]);
+  uint64_t *su64 = malloc(n * sizeof su64[0]);
+  uint32_t *au32 = malloc(n * sizeof au32[0]);
+  for (size_t i = 0; i < n; i++) {
+    au64[i] = ((uint64_t)rand() << 31 | rand()) >> rand() % 62;
+    su64[i] = (i ? su64[i - 1] : 0) + (au64[i] >> rand() % 64);
+    au32[i] = au64[i];
+  }
+
+  // the bytes of every mode at the scalar level, then at each other level
+  size_t errors = 0, clen[4], len;
+  uint8_t *ref[4];
+  int isa = vb64_get_isa();
+  errors += vb64_set_isa(vb64_isa_scalar) != 0;
+  ref[0] = vb64_compress(au64, n, &clen[0]);
+  ref[1] = vb64_compress_delta(su64, n, &clen[1]);
+  ref[2] = vb64_compress_zdelta(au64, n, &clen[2]);
+  ref[3] = vb32_compress_delta(au32, n, &clen[3]);
+  uint64_t *d64 = malloc(n * sizeof d64[0]);
+  uint32_t *d32 = malloc(n * sizeof d32[0]);
+  for (int l = vb64_isa_scalar; l < vb64_isa_count; l++) {
+    if (!vb64_isa_name(l))
+      continue;
+    errors += vb64_set_isa(l) != 0 || vb64_get_isa() != l;
+    fprintf(stderr, "[isa ] %s\n", vb64_isa_name(l));
+    uint8_t *c[4] = {vb64_compress(au64, n, &len), NULL, NULL, NULL};
+    errors += len != clen[0] || memcmp(c[0], ref[0], len);
+    c[1] = vb64_compress_delta(su64, n, &len);
+    errors += len != clen[1] || memcmp(c[1], ref[1], len);
+    c[2] = vb64_compress_zdelta(au64, n, &len);
+    errors += len != clen[2] || memcmp(c[2], ref[2], len);
+    c[3] = vb32_compress_delta(au32, n, &len);
+    errors += len != clen[3] || memcmp(c[3], ref[3], len);
+
+    vb64_decompress(ref[0], d64, n);
+    for (size_t i = 0; i < n; i++)
+      errors += au64[i] != d64[i];
+    vb64_decompress_delta(ref[1], d64, n);
+    for (size_t i = 0; i < n; i++)
+      errors += su64[i] != d64[i];
+    vb64_decompress_zdelta(ref[2], d64, n);
+    for (size_t i = 0; i < n; i++)
+      errors += au64[i] != d64[i];
+    vb32_decompress_delta(ref[3], d32, n);
+    for (size_t i = 0; i < n; i++)
+      errors += au32[i] != d32[i];
+    for (int k = 0; k < 4; k++)
+      free(c[k]);
+  }
+  errors += vb64_set_isa(vb64_isa_count) != -1 || vb64_isa_name(-1);
+  errors += vb64_set_isa(isa) != 0;
+  fprintf(stderr, "[decode] errors = %zu\n", errors);
+
+  for (int k = 0; k < 4; k++)
+    free(ref[k]);
+  free(d64);
+  free(d32);
+  free(au64);
+  free(su64);
+  free(au32);
+}
+
 int main(int argc, char *argv[]) {
   size_t test_size = 5e5;
   // test_encdec_delta(test_size);
@@ -364,5 +1323,23 @@ int main(int argc, char *argv[]) {
   // sanity_check();
   // sanity_check_wl();
   sanity_check_file();
+  test_encdec_mixed(1e4);
+  test_arena(1e4);
+  test_blocked(1e5 + 1);
+  test_adaptive(1e5 + 1);
+  test_setops(1e5 + 1);
+  test_mt(1e6 + 1);
+  test_encdec_delta_mapfile(1e5 + 1);
+  test_stream(3e5 + 1);
+  test_segmentfile(1e5 + 1);
+  test_container(1e4 + 1);
+  test_load(1e5 + 1);
+  test_grouped(1e5 + 1);
+  test_zdelta(1e5 + 1);
+  test_extended(1e5 + 1);
+  test_width(1e5 + 1);
+  test_small();
+  test_isa(1e5 + 1);
+  test_aggregate(1e5 + 1);
   return EXIT_SUCCESS;
 }
@@ -1,9 +1,158 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include "vbyte64.h"
-#include <setjmp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__GLIBC__) && !defined(__USE_GNU)
+#error "vbyte64 needs _GNU_SOURCE defined before any system header"
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VBYTE64_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__linux__) && !defined(VBYTE64_NO_URING)
+#define VBYTE64_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+// Number of key bytes (2 values each) decoded per step by the delta decoder,
+// small enough for the unpacked block to stay in L1 before accumulation.
+#define VBYTE64_BLOCK_PAIRS 512
+
+// Allocators
+
+static void *vb64_std_alloc(size_t size, void *ud) {
+  (void)ud;
+  return malloc(size);
+}
+
+static void *vb64_std_realloc(void *ptr, size_t size, void *ud) {
+  (void)ud;
+  return realloc(ptr, size);
+}
+
+static void vb64_std_free(void *ptr, void *ud) {
+  (void)ud;
+  free(ptr);
+}
+
+static const struct vb64_allocator vb64_std_allocator = {
+    vb64_std_alloc, vb64_std_realloc, vb64_std_free, NULL};
+
+static _Thread_local struct vb64_allocator vb64_allocator_ = {
+    vb64_std_alloc, vb64_std_realloc, vb64_std_free, NULL};
+
+void vb64_set_allocator(const struct vb64_allocator *a) {
+  vb64_allocator_ = a ? *a : vb64_std_allocator;
+}
+
+static inline void *vb64_malloc(size_t size) {
+  return vb64_allocator_.alloc(size, vb64_allocator_.ud);
+}
+
+// only ever used to shrink, returns `ptr` when the allocator cannot do it
+static inline void *vb64_shrink(void *ptr, size_t size) {
+  if (!vb64_allocator_.realloc)
+    return ptr;
+  void *shrunk = vb64_allocator_.realloc(ptr, size, vb64_allocator_.ud);
+  return shrunk ? shrunk : ptr;
+}
+
+void vb64_free(void *ptr) {
+  if (ptr && vb64_allocator_.free)
+    vb64_allocator_.free(ptr, vb64_allocator_.ud);
+}
+
+// Arena: chain of blocks, each one starting with its header
+struct vb64_arena_block {
+  struct vb64_arena_block *next;
+  size_t size, used;
+};
+
+#define VBYTE64_ARENA_ALIGN 16
+#define VBYTE64_ARENA_HEAD                                                     \
+  ((sizeof(struct vb64_arena_block) + VBYTE64_ARENA_ALIGN - 1) &               \
+   ~(size_t)(VBYTE64_ARENA_ALIGN - 1))
+
+void vb64_arena_init(struct vb64_arena *a, size_t block_size) {
+  a->head = NULL;
+  a->last = NULL;
+  a->block_size = block_size;
+}
+
+void *vb64_arena_alloc(struct vb64_arena *a, size_t size) {
+  size = (size + VBYTE64_ARENA_ALIGN - 1) & ~(size_t)(VBYTE64_ARENA_ALIGN - 1);
+  struct vb64_arena_block *b = a->head;
+  if (!b || b->size - b->used < size) {
+    size_t bsize = size > a->block_size ? size : a->block_size;
+    b = malloc(VBYTE64_ARENA_HEAD + bsize);
+    if (!b)
+      return NULL;
+    b->next = a->head;
+    b->size = bsize;
+    b->used = 0;
+    a->head = b;
+  }
+  a->last = (uint8_t *)b + VBYTE64_ARENA_HEAD + b->used;
+  b->used += size;
+  return a->last;
+}
+
+void vb64_arena_reset(struct vb64_arena *a) {
+  // keep the most recent block, it is the one worth reusing
+  struct vb64_arena_block *b = a->head;
+  if (!b)
+    return;
+  for (struct vb64_arena_block *o = b->next, *next; o; o = next) {
+    next = o->next;
+    free(o);
+  }
+  b->next = NULL;
+  b->used = 0;
+  a->last = NULL;
+}
+
+void vb64_arena_destroy(struct vb64_arena *a) {
+  vb64_arena_reset(a);
+  free(a->head);
+  a->head = NULL;
+}
+
+static void *vb64_arena_alloc_(size_t size, void *ud) {
+  return vb64_arena_alloc((struct vb64_arena *)ud, size);
+}
+
+static void *vb64_arena_realloc_(void *ptr, size_t size, void *ud) {
+  // shrinking the last allocation gives the tail back to the arena
+  struct vb64_arena *a = (struct vb64_arena *)ud;
+  struct vb64_arena_block *b = a->head;
+  if (ptr == a->last && b) {
+    size = (size + VBYTE64_ARENA_ALIGN - 1) & ~(size_t)(VBYTE64_ARENA_ALIGN - 1);
+    size_t offset = (uint8_t *)ptr - ((uint8_t *)b + VBYTE64_ARENA_HEAD);
+    if (offset + size <= b->used)
+      b->used = offset + size;
+  }
+  return ptr;
+}
+
+struct vb64_allocator vb64_arena_allocator(struct vb64_arena *a) {
+  struct vb64_allocator alloc = {vb64_arena_alloc_, vb64_arena_realloc_, NULL,
+                                 a};
+  return alloc;
+}
 
 static inline uint8_t vb64_benc_noclz(uint64_t v,
                                       uint8_t *__restrict__ *data_pp) {
@@ -39,8 +188,74 @@ static inline uint8_t vb64_benc(uint64_t v, uint8_t *__restrict__ *data_pp) {
   return code;
 }
 
-size_t vb64d_encode_size(const uint64_t *v, size_t n) {
+// the byte encoder selected by `VBYTE64_NO_CLZ`
+static inline uint8_t vb64_benc_sel(uint64_t v,
+                                    uint8_t *__restrict__ *data_pp) {
+#ifdef VBYTE64_NO_CLZ
+  return vb64_benc_noclz(v, data_pp);
+#else
+  return vb64_benc(v, data_pp);
+#endif /* ifdef VBYTE64_NO_CLZ */
+}
+
+// SIMD tables, indexed by a full key byte (two values).
+// `vb64_klen` is the number of data bytes used by the pair, while
+// `vb64_dec_shuf` moves the bytes of the pair into two zero-extended
+// 64-bit lanes with a single `pshufb` and `vb64_enc_shuf` does the opposite.
+// `vb64_mlen` maps the mask of the non-zero bytes of a value to its code.
+static uint8_t vb64_klen[256];
+static uint8_t vb64_mlen[256];
+#ifdef VBYTE64_X86
+static uint8_t vb64_dec_shuf[256][16] __attribute__((aligned(16)));
+static uint8_t vb64_enc_shuf[256][16] __attribute__((aligned(16)));
+
+// low lane of `x`, through memory as `_mm_cvtsi128_si64` is x86-64 only
+__attribute__((target("sse2"))) static inline uint64_t vb64_lo64(__m128i x) {
+  uint64_t v;
+  _mm_storel_epi64((__m128i *)&v, x);
+  return v;
+}
+#endif /* ifdef VBYTE64_X86 */
+
+static void vb64_tables_init(void) {
+  for (int k = 0; k < 256; ++k) {
+    // codes above 8 are never produced by the encoder, clamp them so that
+    // corrupted keys can never index outside the 16 loaded bytes
+    uint8_t l0 = (k & 0xF) > 8 ? 8 : (k & 0xF);
+    uint8_t l1 = (k >> 4) > 8 ? 8 : (k >> 4);
+    vb64_klen[k] = l0 + l1;
+    vb64_mlen[k] = k ? 32 - __builtin_clz(k) : 0;
+#ifdef VBYTE64_X86
+    for (int i = 0; i < 8; ++i) {
+      vb64_dec_shuf[k][i] = i < l0 ? i : 0x80;
+      vb64_dec_shuf[k][8 + i] = i < l1 ? l0 + i : 0x80;
+    }
+    for (int i = 0; i < 16; ++i)
+      vb64_enc_shuf[k][i] = i < l0 ? i : (i < l0 + l1 ? 8 + i - l0 : 0x80);
+#endif /* ifdef VBYTE64_X86 */
+  }
+}
+
+// maps the signed delta `d` to 2|d|, or 2|d| - 1 if negative
+static inline uint64_t vb64_zigzag(uint64_t d) {
+  return d << 1 ^ (uint64_t)((int64_t)d >> 63);
+}
+
+static size_t vb64zd_encode_size(const uint64_t *v, size_t n) {
+  size_t nbytes = 0;
+  uint64_t prev = 0;
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t z = vb64_zigzag(v[i] - prev);
+    nbytes += z ? 8U - (__builtin_clzll(z | 1) >> 3) : 0;
+    prev = v[i];
+  }
+  return nbytes;
+}
+
+VBYTE64_API size_t vb64d_encode_size(const uint64_t *v, size_t n) {
   size_t nbytes = 0, i;
+  if (!n)
+    return 0;
   uint64_t vo_ = v[0], v_ = vo_;
   nbytes = vo_ ? 8U - (__builtin_clzll(vo_ | 1) >> 3) : 0;
   for (i = 1; i < n; ++i) {
@@ -51,7 +266,7 @@ size_t vb64d_encode_size(const uint64_t *v, size_t n) {
   return nbytes;
 }
 
-size_t vb64_encode_size(const uint64_t *v, size_t n) {
+VBYTE64_API size_t vb64_encode_size(const uint64_t *v, size_t n) {
   size_t nbytes = 0, i;
   // uint64_t vo_ = v[0], v_ = vo_;
   // nbytes = vo_ ? 8U - (__builtin_clzll(vo_ | 1) >> 3) : 0;
@@ -61,8 +276,10 @@ size_t vb64_encode_size(const uint64_t *v, size_t n) {
   return nbytes;
 }
 
-size_t vb64d_encode_size_noclz(const uint64_t *v, size_t n) {
+VBYTE64_API size_t vb64d_encode_size_noclz(const uint64_t *v, size_t n) {
   size_t nbytes = 0, i;
+  if (!n)
+    return 0;
   uint64_t vo_ = v[0], v_ = vo_;
   nbytes += (v_ > 0) + (v_ > 0x00000000000000FF) + (v_ > 0x000000000000FFFF) +
             (v_ > 0x0000000000FFFFFF) + (v_ > 0x00000000FFFFFFFF) +
@@ -80,7 +297,7 @@ size_t vb64d_encode_size_noclz(const uint64_t *v, size_t n) {
   return nbytes;
 }
 
-size_t vb64_encode_size_noclz(const uint64_t *v, size_t n) {
+VBYTE64_API size_t vb64_encode_size_noclz(const uint64_t *v, size_t n) {
   size_t nbytes = 0, i;
   uint64_t v_;
   for (i = 0; i < n; ++i) {
@@ -142,70 +359,246 @@ size_t vb64_compressed_size(const uint64_t *v, size_t n) {
   return key_size + data_size + VBYTE64_PADDING;
 }
 
-static uint8_t *vb64_encode_delta(uint8_t *key_p, uint8_t *data_p,
-                                  const uint64_t *v, size_t n) {
-  uint8_t shift_ = 0, ckey = 0, code = 0;
-  uint64_t ov = v[0], cv;
-  // first one must be encoded fully
+/*
+ * Calculate the exact size required to compress array `v` of size `n`
+ * using zigzag delta variable byte encoding.
+ */
+size_t vb64zd_compressed_size(const uint64_t *v, size_t n) {
+  size_t key_size = sizeof(uint8_t) * ((n + 1) / 2);
+  return key_size + vb64zd_encode_size(v, n) + VBYTE64_PADDING;
+}
+
+// An encode kernel writes `npairs` full key bytes (2 values each) and the
+// corresponding data, returning the pointer to the first unused data byte.
+// The delta flavour encodes the difference with the previous value, `prev`
+// standing for the one before `v[0]`.
+// SIMD kernels may write up to 16 bytes past the data of the last pair, that
+// is always inside the `VBYTE64_PADDING` of the compressed buffer.
+typedef uint8_t *(*vb64_enc_fn)(uint8_t *key_p, uint8_t *data_p,
+                                const uint64_t *v, size_t npairs,
+                                uint64_t prev);
+
+static inline __attribute__((always_inline)) uint8_t *
+vb64_enc_pairs_scalar_t(uint8_t *key_p, uint8_t *data_p, const uint64_t *v,
+                        size_t npairs, uint64_t prev, int delta) {
+  for (size_t i = 0; i < npairs; ++i) {
+    uint64_t v0 = v[2 * i], v1 = v[2 * i + 1];
+    uint64_t d0 = delta ? v0 - prev : v0, d1 = delta ? v1 - v0 : v1;
 #ifdef VBYTE64_NO_CLZ
-  code = vb64_benc_noclz(v[0], &data_p);
+    uint8_t c0 = vb64_benc_noclz(d0, &data_p);
+    uint8_t c1 = vb64_benc_noclz(d1, &data_p);
 #else
-  code = vb64_benc(v[0], &data_p);
+    uint8_t c0 = vb64_benc(d0, &data_p);
+    uint8_t c1 = vb64_benc(d1, &data_p);
 #endif /* ifdef VBYTE64_NO_CLZ */
+    key_p[i] = c0 | (c1 << 4);
+    prev = v1;
+  }
+  return data_p;
+}
+
+static uint8_t *vb64_enc_pairs_scalar(uint8_t *key_p, uint8_t *data_p,
+                                      const uint64_t *v, size_t npairs,
+                                      uint64_t prev) {
+  return vb64_enc_pairs_scalar_t(key_p, data_p, v, npairs, prev, 0);
+}
+
+static uint8_t *vb64_enc_pairs_delta_scalar(uint8_t *key_p, uint8_t *data_p,
+                                            const uint64_t *v, size_t npairs,
+                                            uint64_t prev) {
+  return vb64_enc_pairs_scalar_t(key_p, data_p, v, npairs, prev, 1);
+}
+
+#ifdef VBYTE64_X86
+__attribute__((target("avx2"))) static inline
+    __attribute__((always_inline)) uint8_t *
+    vb64_enc_pairs_avx2_t(uint8_t *key_p, uint8_t *data_p, const uint64_t *v,
+                          size_t npairs, uint64_t prev, int delta) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i carry = _mm256_set1_epi64x(prev);
+  size_t i = 0;
+  // four values per iteration: the byte length of each lane is the position
+  // of its highest non-zero byte, then each pair is compacted by a shuffle
+  for (; i + 2 <= npairs; i += 2) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(v + 2 * i));
+    if (delta) {
+      // [prev, x0, x1, x2]
+      __m256i y = _mm256_blend_epi32(_mm256_permute4x64_epi64(x, 0x90), carry,
+                                     0x03);
+      carry = _mm256_permute4x64_epi64(x, 0xFF);
+      x = _mm256_sub_epi64(x, y);
+    }
+    uint32_t nz = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, zero));
+    uint8_t k0 = vb64_mlen[nz & 0xFF] | (vb64_mlen[(nz >> 8) & 0xFF] << 4);
+    uint8_t k1 =
+        vb64_mlen[(nz >> 16) & 0xFF] | (vb64_mlen[nz >> 24] << 4);
+    __m256i s = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(
+            _mm_load_si128((const __m128i *)vb64_enc_shuf[k0])),
+        _mm_load_si128((const __m128i *)vb64_enc_shuf[k1]), 1);
+    x = _mm256_shuffle_epi8(x, s);
+    _mm_storeu_si128((__m128i *)data_p, _mm256_castsi256_si128(x));
+    data_p += vb64_klen[k0];
+    _mm_storeu_si128((__m128i *)data_p, _mm256_extracti128_si256(x, 1));
+    data_p += vb64_klen[k1];
+    key_p[i] = k0;
+    key_p[i + 1] = k1;
+  }
+  if (i < npairs)
+    data_p = vb64_enc_pairs_scalar_t(key_p + i, data_p, v + 2 * i, 1,
+                                     i ? v[2 * i - 1] : prev, delta);
+  return data_p;
+}
+
+__attribute__((target("avx2"))) static uint8_t *
+vb64_enc_pairs_avx2(uint8_t *key_p, uint8_t *data_p, const uint64_t *v,
+                    size_t npairs, uint64_t prev) {
+  return vb64_enc_pairs_avx2_t(key_p, data_p, v, npairs, prev, 0);
+}
 
-  ckey |= code << shift_;
-  shift_ += 4;
+__attribute__((target("avx2"))) static uint8_t *
+vb64_enc_pairs_delta_avx2(uint8_t *key_p, uint8_t *data_p, const uint64_t *v,
+                          size_t npairs, uint64_t prev) {
+  return vb64_enc_pairs_avx2_t(key_p, data_p, v, npairs, prev, 1);
+}
 
-  for (size_t i = 1; i < n; i++) {
-    if (shift_ == 8) {
-      shift_ = 0;
-      *key_p++ = ckey;
-      ckey = 0;
+__attribute__((target("avx512f,avx512cd,avx512bw"))) static inline
+    __attribute__((always_inline)) uint8_t *
+    vb64_enc_pairs_avx512_t(uint8_t *key_p, uint8_t *data_p, const uint64_t *v,
+                            size_t npairs, uint64_t prev, int delta) {
+  const __m512i idx = _mm512_set_epi64(6, 5, 4, 3, 2, 1, 0, 0);
+  __m512i carry = _mm512_set1_epi64(prev);
+  size_t i = 0;
+  // eight values per iteration, byte lengths straight from lzcnt
+  for (; i + 4 <= npairs; i += 4) {
+    __m512i x = _mm512_loadu_si512(v + 2 * i);
+    if (delta) {
+      __m512i y = _mm512_mask_permutexvar_epi64(carry, 0xFE, idx, x);
+      carry = _mm512_permutexvar_epi64(_mm512_set1_epi64(7), x);
+      x = _mm512_sub_epi64(x, y);
     }
-    cv = v[i];
+    __m512i len = _mm512_srli_epi64(
+        _mm512_sub_epi64(_mm512_set1_epi64(71), _mm512_lzcnt_epi64(x)), 3);
+    uint64_t lens = vb64_lo64(_mm512_cvtepi64_epi8(len));
+    uint8_t k[4];
+    for (int j = 0; j < 4; ++j)
+      k[j] = (lens >> (16 * j)) | ((lens >> (16 * j + 4)) & 0xF0);
+    __m512i s = _mm512_castsi128_si512(
+        _mm_load_si128((const __m128i *)vb64_enc_shuf[k[0]]));
+    s = _mm512_inserti32x4(
+        s, _mm_load_si128((const __m128i *)vb64_enc_shuf[k[1]]), 1);
+    s = _mm512_inserti32x4(
+        s, _mm_load_si128((const __m128i *)vb64_enc_shuf[k[2]]), 2);
+    s = _mm512_inserti32x4(
+        s, _mm_load_si128((const __m128i *)vb64_enc_shuf[k[3]]), 3);
+    x = _mm512_shuffle_epi8(x, s);
+    _mm_storeu_si128((__m128i *)data_p, _mm512_castsi512_si128(x));
+    data_p += vb64_klen[k[0]];
+    _mm_storeu_si128((__m128i *)data_p, _mm512_extracti32x4_epi32(x, 1));
+    data_p += vb64_klen[k[1]];
+    _mm_storeu_si128((__m128i *)data_p, _mm512_extracti32x4_epi32(x, 2));
+    data_p += vb64_klen[k[2]];
+    _mm_storeu_si128((__m128i *)data_p, _mm512_extracti32x4_epi32(x, 3));
+    data_p += vb64_klen[k[3]];
+    memcpy(key_p + i, k, 4);
+  }
+  return vb64_enc_pairs_scalar_t(key_p + i, data_p, v + 2 * i, npairs - i,
+                                 i ? v[2 * i - 1] : prev, delta);
+}
+
+__attribute__((target("avx512f,avx512cd,avx512bw"))) static uint8_t *
+vb64_enc_pairs_avx512(uint8_t *key_p, uint8_t *data_p, const uint64_t *v,
+                      size_t npairs, uint64_t prev) {
+  return vb64_enc_pairs_avx512_t(key_p, data_p, v, npairs, prev, 0);
+}
+
+__attribute__((target("avx512f,avx512cd,avx512bw"))) static uint8_t *
+vb64_enc_pairs_delta_avx512(uint8_t *key_p, uint8_t *data_p,
+                            const uint64_t *v, size_t npairs, uint64_t prev) {
+  return vb64_enc_pairs_avx512_t(key_p, data_p, v, npairs, prev, 1);
+}
+#endif /* ifdef VBYTE64_X86 */
+
+static vb64_enc_fn vb64_enc_pairs = vb64_enc_pairs_scalar;
+static vb64_enc_fn vb64_enc_pairs_delta = vb64_enc_pairs_delta_scalar;
+
+// `prev` is the value preceding `v[0]`, 0 for a full stream
+static uint8_t *vb64_encode_delta_base(uint8_t *key_p, uint8_t *data_p,
+                                       const uint64_t *v, size_t n,
+                                       uint64_t prev) {
+  data_p = vb64_enc_pairs_delta(key_p, data_p, v, n / 2, prev);
+  if (n & 1) {
+    uint64_t ov = n > 1 ? v[n - 2] : prev;
 #ifdef VBYTE64_NO_CLZ
-    code = vb64_benc_noclz(cv - ov, &data_p);
+    key_p[n / 2] = vb64_benc_noclz(v[n - 1] - ov, &data_p);
 #else
-    code = vb64_benc(cv - ov, &data_p);
+    key_p[n / 2] = vb64_benc(v[n - 1] - ov, &data_p);
 #endif /* ifdef VBYTE64_NO_CLZ */
-    ckey |= code << shift_;
-    shift_ += 4;
-    ov = cv;
   }
-  *key_p++ = ckey;
   // pointer to first unused
   return data_p;
 }
 
+static uint8_t *vb64_encode_delta(uint8_t *key_p, uint8_t *data_p,
+                                  const uint64_t *v, size_t n) {
+  // first one must be encoded fully, that is a delta from 0
+  return vb64_encode_delta_base(key_p, data_p, v, n, 0);
+}
+
 static uint8_t *vb64_encode(uint8_t *key_p, uint8_t *data_p, const uint64_t *v,
                             size_t n) {
-  uint8_t shift_ = 0, ckey = 0, code = 0;
-  for (size_t i = 0; i < n; i++) {
-    if (shift_ == 8) {
-      shift_ = 0;
-      *key_p++ = ckey;
-      ckey = 0;
-    }
+  data_p = vb64_enc_pairs(key_p, data_p, v, n / 2, 0);
+  if (n & 1) {
 #ifdef VBYTE64_NO_CLZ
-    code = vb64_benc_noclz(v[i], &data_p);
+    key_p[n / 2] = vb64_benc_noclz(v[n - 1], &data_p);
 #else
-    code = vb64_benc(v[i], &data_p);
+    key_p[n / 2] = vb64_benc(v[n - 1], &data_p);
 #endif /* ifdef VBYTE64_NO_CLZ */
-    ckey |= code << shift_;
-    shift_ += 4;
   }
-  *key_p++ = ckey;
 
   // pointer to first unused
   return data_p;
 }
 
+// Zigzag delta: each difference with the previous value is mapped by
+// `vb64_zigzag`, so that small decreases take as few bytes as small
+// increases. The mapped deltas are staged one cache resident block at the
+// time for the pair kernels.
+static uint8_t *vb64_encode_zdelta_base(uint8_t *key_p, uint8_t *data_p,
+                                        const uint64_t *v, size_t n,
+                                        uint64_t prev) {
+  uint64_t zz[2 * VBYTE64_BLOCK_PAIRS];
+  for (size_t i = 0; i < n; i += 2 * VBYTE64_BLOCK_PAIRS) {
+    size_t m = n - i < 2 * VBYTE64_BLOCK_PAIRS ? n - i : 2 * VBYTE64_BLOCK_PAIRS;
+    for (size_t j = 0; j < m; ++j) {
+      zz[j] = vb64_zigzag(v[i + j] - prev);
+      prev = v[i + j];
+    }
+    data_p = vb64_encode(key_p + i / 2, data_p, zz, m);
+  }
+  return data_p;
+}
+
+// Encodings of a whole stream, for the functions taking a `mode`
+enum vb64_mode { vb64_plain = 0, vb64_delta, vb64_zdelta };
+
+// `prev` is the value preceding `v[0]` in the delta modes
+static uint8_t *vb64_encode_mode(uint8_t *key_p, uint8_t *data_p,
+                                 const uint64_t *v, size_t n, uint64_t prev,
+                                 int mode) {
+  if (mode == vb64_zdelta)
+    return vb64_encode_zdelta_base(key_p, data_p, v, n, prev);
+  if (mode == vb64_delta)
+    return vb64_encode_delta_base(key_p, data_p, v, n, prev);
+  return vb64_encode(key_p, data_p, v, n);
+}
+
 uint8_t *vb64_compress_delta(uint64_t *v, size_t n, size_t *clen) {
   size_t key_size = sizeof(uint8_t) * ((n + 1) / 2);
   size_t data_size = vb64d_encode_size(v, n);
   size_t compress_size = key_size + data_size + VBYTE64_PADDING;
 
-  uint8_t *cdata = (uint8_t *)malloc(compress_size);
+  uint8_t *cdata = (uint8_t *)vb64_malloc(compress_size);
   if (!cdata)
     return NULL;
   uint8_t *key_p = cdata;
@@ -223,7 +616,7 @@ uint8_t *vb64_compress(uint64_t *v, size_t n, size_t *clen) {
   size_t data_size = vb64_encode_size(v, n);
   size_t compress_size = key_size + data_size + VBYTE64_PADDING;
 
-  uint8_t *cdata = (uint8_t *)malloc(compress_size);
+  uint8_t *cdata = (uint8_t *)vb64_malloc(compress_size);
   if (!cdata)
     return NULL;
   uint8_t *key_p = cdata;
@@ -241,7 +634,7 @@ uint8_t *vb64_compress_delta_wl(uint64_t *v, size_t n, size_t *clen) {
   size_t data_size = vb64d_encode_size(v, n);
   size_t compress_size = key_size + data_size + VBYTE64_PADDING;
 
-  uint8_t *cdata = (uint8_t *)malloc(compress_size);
+  uint8_t *cdata = (uint8_t *)vb64_malloc(compress_size);
   if (!cdata)
     return NULL;
   uint8_t *key_p = cdata;
@@ -262,7 +655,7 @@ uint8_t *vb64_compress_wl(uint64_t *v, size_t n, size_t *clen) {
   size_t data_size = vb64_encode_size(v, n);
   size_t compress_size = key_size + data_size + VBYTE64_PADDING;
 
-  uint8_t *cdata = (uint8_t *)malloc(compress_size);
+  uint8_t *cdata = (uint8_t *)vb64_malloc(compress_size);
   if (!cdata)
     return NULL;
   uint8_t *key_p = cdata;
@@ -279,6 +672,127 @@ uint8_t *vb64_compress_wl(uint64_t *v, size_t n, size_t *clen) {
   return cdata;
 }
 
+static uint8_t *vb64_compress_zdelta_(uint64_t *v, size_t n, size_t *clen,
+                                      int wl) {
+  size_t head_size = wl ? sizeof(size_t) : 0;
+  size_t key_size = sizeof(uint8_t) * ((n + 1) / 2);
+  size_t compress_size =
+      head_size + key_size + vb64zd_encode_size(v, n) + VBYTE64_PADDING;
+
+  uint8_t *cdata = (uint8_t *)vb64_malloc(compress_size);
+  if (!cdata)
+    return NULL;
+  if (wl)
+    memcpy(cdata, &n, sizeof(size_t));
+  uint8_t *key_p = cdata + head_size;
+
+  uint8_t *data_p_end =
+      vb64_encode_zdelta_base(key_p, key_p + key_size, v, n, 0);
+  if (clen)
+    *clen = data_p_end - cdata;
+  return cdata;
+}
+
+uint8_t *vb64_compress_zdelta(uint64_t *v, size_t n, size_t *clen) {
+  return vb64_compress_zdelta_(v, n, clen, 0);
+}
+
+uint8_t *vb64_compress_zdelta_wl(uint64_t *v, size_t n, size_t *clen) {
+  return vb64_compress_zdelta_(v, n, clen, 1);
+}
+
+/*
+ * Upper bound of the compressed size of any array of `n` values: every value
+ * takes at most 8 data bytes, plus the keys and the padding.
+ */
+size_t vb64_max_compressed_size(size_t n) {
+  return sizeof(uint8_t) * ((n + 1) / 2) + sizeof(uint64_t) * n +
+         VBYTE64_PADDING;
+}
+
+static size_t vb64_compress_into_(uint64_t *v, size_t n, uint8_t *out,
+                                  size_t cap, int wl, int delta) {
+  size_t head_size = wl ? sizeof(size_t) : 0;
+  size_t key_size = head_size + sizeof(uint8_t) * ((n + 1) / 2);
+  if (cap < head_size + vb64_max_compressed_size(n)) {
+    // only scan for the exact size when the bound does not fit
+    size_t data_size = delta ? vb64d_encode_size(v, n) : vb64_encode_size(v, n);
+    if (cap < key_size + data_size + VBYTE64_PADDING)
+      return 0;
+  }
+
+  uint8_t *key_p = out;
+  if (wl) {
+    // copy size to the first bytes
+    memcpy(key_p, &n, sizeof(size_t));
+    key_p += sizeof(size_t);
+  }
+  uint8_t *data_p = out + key_size;
+
+  uint8_t *data_p_end = delta ? vb64_encode_delta(key_p, data_p, v, n)
+                              : vb64_encode(key_p, data_p, v, n);
+  return data_p_end - out;
+}
+
+size_t vb64_compress_delta_into(uint64_t *v, size_t n, uint8_t *out,
+                                size_t cap) {
+  return vb64_compress_into_(v, n, out, cap, 0, 1);
+}
+
+size_t vb64_compress_into(uint64_t *v, size_t n, uint8_t *out, size_t cap) {
+  return vb64_compress_into_(v, n, out, cap, 0, 0);
+}
+
+size_t vb64_compress_delta_wl_into(uint64_t *v, size_t n, uint8_t *out,
+                                   size_t cap) {
+  return vb64_compress_into_(v, n, out, cap, 1, 1);
+}
+
+size_t vb64_compress_wl_into(uint64_t *v, size_t n, uint8_t *out,
+                             size_t cap) {
+  return vb64_compress_into_(v, n, out, cap, 1, 0);
+}
+
+static uint8_t *vb64_compress_onepass_(uint64_t *v, size_t n, size_t *clen,
+                                       int shrink, int wl, int delta) {
+  // pages of the bound that are never written are never faulted in either
+  size_t compress_size =
+      (wl ? sizeof(size_t) : 0) + vb64_max_compressed_size(n);
+
+  uint8_t *cdata = (uint8_t *)vb64_malloc(compress_size);
+  if (!cdata)
+    return NULL;
+  size_t used = vb64_compress_into_(v, n, cdata, compress_size, wl, delta);
+
+  if (shrink) {
+    // keep the padding, the shrunk buffer is still safe to decode
+    cdata = (uint8_t *)vb64_shrink(cdata, used + VBYTE64_PADDING);
+  }
+  if (clen)
+    *clen = used;
+  return cdata;
+}
+
+uint8_t *vb64_compress_delta_onepass(uint64_t *v, size_t n, size_t *clen,
+                                     int shrink) {
+  return vb64_compress_onepass_(v, n, clen, shrink, 0, 1);
+}
+
+uint8_t *vb64_compress_onepass(uint64_t *v, size_t n, size_t *clen,
+                               int shrink) {
+  return vb64_compress_onepass_(v, n, clen, shrink, 0, 0);
+}
+
+uint8_t *vb64_compress_delta_wl_onepass(uint64_t *v, size_t n, size_t *clen,
+                                        int shrink) {
+  return vb64_compress_onepass_(v, n, clen, shrink, 1, 1);
+}
+
+uint8_t *vb64_compress_wl_onepass(uint64_t *v, size_t n, size_t *clen,
+                                  int shrink) {
+  return vb64_compress_onepass_(v, n, clen, shrink, 1, 0);
+}
+
 static inline uint64_t vb64_bdec(const uint8_t **data_pp, uint8_t code) {
   // uint64_t val = 0;
   // const uint8_t *data_p = *data_pp;
@@ -293,54 +807,429 @@ static inline uint64_t vb64_bdec(const uint8_t **data_pp, uint8_t code) {
   return val;
 }
 
-static const uint8_t *vb64_decode_delta(const uint8_t *key_p,
+// A pair kernel decodes `npairs` full key bytes (2 values each) and returns
+// the pointer to the first unused data byte.
+// SIMD kernels may read up to 16 bytes past the data of the last pair, the
+// callers are responsible of never letting them run off the input.
+typedef const uint8_t *(*vb64_pairs_fn)(const uint8_t *key_p,
                                         const uint8_t *data_p, uint64_t *o,
-                                        size_t n) {
-  if (n == 0)
-    return data_p;
-
-  // first value if fully encoded
-  uint8_t key = *key_p++;
-  uint64_t prev = vb64_bdec(&data_p, key & 0xF), val = 0;
-  *o++ = prev;
-  uint8_t shift_ = 4;
+                                        size_t npairs);
+
+static const uint8_t *vb64_dec_pairs_scalar(const uint8_t *key_p,
+                                            const uint8_t *data_p, uint64_t *o,
+                                            size_t npairs) {
+  for (size_t i = 0; i < npairs; ++i) {
+    uint8_t key = key_p[i];
+    *o++ = vb64_bdec(&data_p, key & 0xF);
+    *o++ = vb64_bdec(&data_p, key >> 4);
+  }
+  return data_p;
+}
 
-  for (size_t i = 1; i < n; ++i) {
-    if (shift_ == 8) {
-      shift_ = 0;
-      key = *key_p++;
-    }
+#ifdef VBYTE64_X86
+__attribute__((target("ssse3"))) static const uint8_t *
+vb64_dec_pairs_ssse3(const uint8_t *key_p, const uint8_t *data_p, uint64_t *o,
+                     size_t npairs) {
+  for (size_t i = 0; i < npairs; ++i) {
+    uint8_t key = key_p[i];
+    __m128i d = _mm_loadu_si128((const __m128i *)data_p);
+    __m128i s = _mm_load_si128((const __m128i *)vb64_dec_shuf[key]);
+    _mm_storeu_si128((__m128i *)o, _mm_shuffle_epi8(d, s));
+    data_p += vb64_klen[key];
+    o += 2;
+  }
+  return data_p;
+}
 
-    val = vb64_bdec(&data_p, (key >> shift_) & 0xF);
-    val += prev;
-    *o++ = val;
-    prev = val;
-    shift_ += 4;
+__attribute__((target("avx2"))) static const uint8_t *
+vb64_dec_pairs_avx2(const uint8_t *key_p, const uint8_t *data_p, uint64_t *o,
+                    size_t npairs) {
+  size_t i = 0;
+  // two key bytes per iteration, each 128-bit lane shuffles its own load
+  for (; i + 2 <= npairs; i += 2) {
+    uint8_t k0 = key_p[i], k1 = key_p[i + 1];
+    const uint8_t *d1_p = data_p + vb64_klen[k0];
+    __m256i d = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)data_p)),
+        _mm_loadu_si128((const __m128i *)d1_p), 1);
+    __m256i s = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(
+            _mm_load_si128((const __m128i *)vb64_dec_shuf[k0])),
+        _mm_load_si128((const __m128i *)vb64_dec_shuf[k1]), 1);
+    _mm256_storeu_si256((__m256i *)o, _mm256_shuffle_epi8(d, s));
+    data_p = d1_p + vb64_klen[k1];
+    o += 4;
   }
+  if (i < npairs)
+    data_p = vb64_dec_pairs_ssse3(key_p + i, data_p, o, 1);
+  return data_p;
+}
 
+// Without shuffles: the 16 bytes of a pair are read as two 8 bytes loads,
+// the first at the data of the pair and the second at the data of its high
+// value, each truncated to its length by `bzhi` (a no-op for 8 bytes).
+__attribute__((target("bmi2"))) static const uint8_t *
+vb64_dec_pairs_bmi2(const uint8_t *key_p, const uint8_t *data_p, uint64_t *o,
+                    size_t npairs) {
+  for (size_t i = 0; i < npairs; ++i) {
+    uint8_t key = key_p[i];
+    // clamped as in the tables, so that corrupted keys stay in the 16 bytes
+    unsigned l0 = vb64_klen[key & 0xF], l1 = vb64_klen[key >> 4];
+    uint64_t lo, hi;
+    memcpy(&lo, data_p, sizeof(lo));
+    memcpy(&hi, data_p + l0, sizeof(hi));
+#ifdef __x86_64__
+    o[0] = _bzhi_u64(lo, 8 * l0);
+    o[1] = _bzhi_u64(hi, 8 * l1);
+#else
+    // there is no 64-bit `bzhi` on 32-bit x86
+    o[0] = l0 < 8 ? lo & ((1ULL << 8 * l0) - 1) : lo;
+    o[1] = l1 < 8 ? hi & ((1ULL << 8 * l1) - 1) : hi;
+#endif /* ifdef __x86_64__ */
+    data_p += l0 + l1;
+    o += 2;
+  }
   return data_p;
 }
+#endif /* ifdef VBYTE64_X86 */
 
-static const uint8_t *vb64_decode(const uint8_t *key_p, const uint8_t *data_p,
-                                  uint64_t *o, size_t n) {
-  if (n == 0)
-    return data_p;
+// An inclusive scan kernel turns the `n` deltas in `o` into values, starting
+// from `prev`, and returns the last value.
+typedef uint64_t (*vb64_scan_fn)(uint64_t *o, size_t n, uint64_t prev);
 
-  uint8_t shift_ = 0, key = *key_p++;
+static uint64_t vb64_scan_scalar(uint64_t *o, size_t n, uint64_t prev) {
+  for (size_t i = 0; i < n; ++i) {
+    prev += o[i];
+    o[i] = prev;
+  }
+  return prev;
+}
 
+// The `zscan` kernels undo the zigzag mapping of each delta before the scan.
+static uint64_t vb64_zscan_scalar(uint64_t *o, size_t n, uint64_t prev) {
   for (size_t i = 0; i < n; ++i) {
-    if (shift_ == 8) {
-      shift_ = 0;
-      key = *key_p++;
-    }
+    prev += (o[i] >> 1) ^ -(o[i] & 1);
+    o[i] = prev;
+  }
+  return prev;
+}
+
+#ifdef VBYTE64_X86
+__attribute__((target("sse2"))) static uint64_t
+vb64_scan_sse2(uint64_t *o, size_t n, uint64_t prev) {
+  __m128i carry = _mm_set1_epi64x(prev);
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(o + i));
+    x = _mm_add_epi64(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi64(x, carry);
+    _mm_storeu_si128((__m128i *)(o + i), x);
+    carry = _mm_unpackhi_epi64(x, x);
+  }
+  return vb64_scan_scalar(o + i, n - i, vb64_lo64(carry));
+}
+
+__attribute__((target("sse2"))) static uint64_t
+vb64_zscan_sse2(uint64_t *o, size_t n, uint64_t prev) {
+  const __m128i one = _mm_set1_epi64x(1), zero = _mm_setzero_si128();
+  __m128i carry = _mm_set1_epi64x(prev);
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(o + i));
+    x = _mm_xor_si128(_mm_srli_epi64(x, 1),
+                      _mm_sub_epi64(zero, _mm_and_si128(x, one)));
+    x = _mm_add_epi64(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi64(x, carry);
+    _mm_storeu_si128((__m128i *)(o + i), x);
+    carry = _mm_unpackhi_epi64(x, x);
+  }
+  return vb64_zscan_scalar(o + i, n - i, vb64_lo64(carry));
+}
+
+__attribute__((target("avx2"))) static uint64_t
+vb64_scan_avx2(uint64_t *o, size_t n, uint64_t prev) {
+  __m256i carry = _mm256_set1_epi64x(prev);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(o + i));
+    // [a, a+b, c, c+d] then carry a+b into the upper lane
+    x = _mm256_add_epi64(x, _mm256_slli_si256(x, 8));
+    x = _mm256_add_epi64(
+        x, _mm256_blend_epi32(_mm256_setzero_si256(),
+                              _mm256_permute4x64_epi64(x, 0x55), 0xF0));
+    x = _mm256_add_epi64(x, carry);
+    _mm256_storeu_si256((__m256i *)(o + i), x);
+    carry = _mm256_permute4x64_epi64(x, 0xFF);
+  }
+  return vb64_scan_scalar(o + i, n - i,
+                          vb64_lo64(_mm256_castsi256_si128(carry)));
+}
+
+__attribute__((target("avx2"))) static uint64_t
+vb64_zscan_avx2(uint64_t *o, size_t n, uint64_t prev) {
+  const __m256i one = _mm256_set1_epi64x(1), zero = _mm256_setzero_si256();
+  __m256i carry = _mm256_set1_epi64x(prev);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(o + i));
+    x = _mm256_xor_si256(_mm256_srli_epi64(x, 1),
+                         _mm256_sub_epi64(zero, _mm256_and_si256(x, one)));
+    x = _mm256_add_epi64(x, _mm256_slli_si256(x, 8));
+    x = _mm256_add_epi64(
+        x, _mm256_blend_epi32(zero, _mm256_permute4x64_epi64(x, 0x55), 0xF0));
+    x = _mm256_add_epi64(x, carry);
+    _mm256_storeu_si256((__m256i *)(o + i), x);
+    carry = _mm256_permute4x64_epi64(x, 0xFF);
+  }
+  return vb64_zscan_scalar(o + i, n - i,
+                           vb64_lo64(_mm256_castsi256_si128(carry)));
+}
+
+__attribute__((target("avx512f"))) static uint64_t
+vb64_scan_avx512(uint64_t *o, size_t n, uint64_t prev) {
+  const __m512i zero = _mm512_setzero_si512(), last = _mm512_set1_epi64(7);
+  __m512i carry = _mm512_set1_epi64(prev);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512i x = _mm512_loadu_si512(o + i);
+    // log-step scan, each alignr shifts the lanes up filling with zeros
+    x = _mm512_add_epi64(x, _mm512_alignr_epi64(x, zero, 7));
+    x = _mm512_add_epi64(x, _mm512_alignr_epi64(x, zero, 6));
+    x = _mm512_add_epi64(x, _mm512_alignr_epi64(x, zero, 4));
+    x = _mm512_add_epi64(x, carry);
+    _mm512_storeu_si512(o + i, x);
+    carry = _mm512_permutexvar_epi64(last, x);
+  }
+  return vb64_scan_scalar(o + i, n - i,
+                          vb64_lo64(_mm512_castsi512_si128(carry)));
+}
+
+__attribute__((target("avx512f"))) static uint64_t
+vb64_zscan_avx512(uint64_t *o, size_t n, uint64_t prev) {
+  const __m512i zero = _mm512_setzero_si512(), last = _mm512_set1_epi64(7);
+  const __m512i one = _mm512_set1_epi64(1);
+  __m512i carry = _mm512_set1_epi64(prev);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512i x = _mm512_loadu_si512(o + i);
+    x = _mm512_xor_si512(_mm512_srli_epi64(x, 1),
+                         _mm512_sub_epi64(zero, _mm512_and_si512(x, one)));
+    x = _mm512_add_epi64(x, _mm512_alignr_epi64(x, zero, 7));
+    x = _mm512_add_epi64(x, _mm512_alignr_epi64(x, zero, 6));
+    x = _mm512_add_epi64(x, _mm512_alignr_epi64(x, zero, 4));
+    x = _mm512_add_epi64(x, carry);
+    _mm512_storeu_si512(o + i, x);
+    carry = _mm512_permutexvar_epi64(last, x);
+  }
+  return vb64_zscan_scalar(o + i, n - i,
+                           vb64_lo64(_mm512_castsi512_si128(carry)));
+}
+#endif /* ifdef VBYTE64_X86 */
+
+static vb64_pairs_fn vb64_dec_pairs = vb64_dec_pairs_scalar;
+static vb64_scan_fn vb64_scan = vb64_scan_scalar;
+static vb64_scan_fn vb64_zscan = vb64_zscan_scalar;
+
+// Dispatch: the kernels of each instruction set level. The best level of the
+// CPU is installed at load time, unless `VBYTE64_ISA` names a lower one.
+struct vb64_kernels {
+  const char *name;
+  vb64_pairs_fn dec_pairs;
+  vb64_scan_fn scan, zscan;
+  vb64_enc_fn enc_pairs, enc_pairs_delta;
+};
+
+static const struct vb64_kernels vb64_kernels_[] = {
+    [vb64_isa_scalar] = {"scalar", vb64_dec_pairs_scalar, vb64_scan_scalar,
+                         vb64_zscan_scalar, vb64_enc_pairs_scalar,
+                         vb64_enc_pairs_delta_scalar},
+#ifdef VBYTE64_X86
+    [vb64_isa_ssse3] = {"ssse3", vb64_dec_pairs_ssse3, vb64_scan_sse2,
+                        vb64_zscan_sse2, vb64_enc_pairs_scalar,
+                        vb64_enc_pairs_delta_scalar},
+    [vb64_isa_avx2] = {"avx2", vb64_dec_pairs_avx2, vb64_scan_avx2,
+                       vb64_zscan_avx2, vb64_enc_pairs_avx2,
+                       vb64_enc_pairs_delta_avx2},
+    [vb64_isa_avx512] = {"avx512", vb64_dec_pairs_avx2, vb64_scan_avx512,
+                         vb64_zscan_avx512, vb64_enc_pairs_avx512,
+                         vb64_enc_pairs_delta_avx512},
+    [vb64_isa_bmi2] = {"bmi2", vb64_dec_pairs_bmi2, vb64_scan_sse2,
+                       vb64_zscan_sse2, vb64_enc_pairs_scalar,
+                       vb64_enc_pairs_delta_scalar},
+#endif /* ifdef VBYTE64_X86 */
+};
+
+static int vb64_isa_ = vb64_isa_scalar;
+
+// the narrow widths follow the same level, see vbyte64_width.h
+static void vb32_use_isa(int isa);
+static void vb16_use_isa(int isa);
+
+int vb64_max_isa(void) {
+#ifdef VBYTE64_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") &&
+      __builtin_cpu_supports("avx512cd") && __builtin_cpu_supports("avx512bw"))
+    return vb64_isa_avx512;
+  if (__builtin_cpu_supports("avx2"))
+    return vb64_isa_avx2;
+  if (__builtin_cpu_supports("ssse3"))
+    return vb64_isa_ssse3;
+#endif /* ifdef VBYTE64_X86 */
+  return vb64_isa_scalar;
+}
+
+// the SIMD levels include each other, BMI2 is apart
+static int vb64_isa_supported(int isa) {
+#ifdef VBYTE64_X86
+  if (isa == vb64_isa_bmi2)
+    return __builtin_cpu_supports("bmi2");
+#endif /* ifdef VBYTE64_X86 */
+  return isa >= 0 && isa <= vb64_max_isa();
+}
+
+int vb64_get_isa(void) { return vb64_isa_; }
+
+const char *vb64_isa_name(int isa) {
+  if (!vb64_isa_supported(isa))
+    return NULL;
+  return vb64_kernels_[isa].name;
+}
+
+int vb64_set_isa(int isa) {
+  if (!vb64_isa_supported(isa)) {
+    errno = ENOTSUP;
+    return -1;
+  }
+  const struct vb64_kernels *k = &vb64_kernels_[isa];
+  vb64_dec_pairs = k->dec_pairs;
+  vb64_scan = k->scan;
+  vb64_zscan = k->zscan;
+  vb64_enc_pairs = k->enc_pairs;
+  vb64_enc_pairs_delta = k->enc_pairs_delta;
+  vb32_use_isa(isa);
+  vb16_use_isa(isa);
+  vb64_isa_ = isa;
+  return 0;
+}
+
+__attribute__((constructor)) static void vb64_init(void) {
+  vb64_tables_init();
+  int isa = vb64_max_isa();
+  const char *env = getenv("VBYTE64_ISA");
+  for (int i = 0; env && i < vb64_isa_count; ++i)
+    if (vb64_isa_supported(i) && !strcmp(env, vb64_kernels_[i].name))
+      isa = i;
+  vb64_set_isa(isa);
+}
+
+/*
+ * Number of data bytes of the `n` values whose keys start at `key_p`, as read
+ * by the decoders: an odd last key byte counts both its nibbles, so a corrupt
+ * high one can only make the check stricter.
+ */
+static size_t vb64_data_size(const uint8_t *key_p, size_t n) {
+  size_t data_size = 0;
+  for (size_t i = 0; i < n / 2 + (n & 1); ++i)
+    data_size += vb64_klen[key_p[i]];
+  return data_size;
+}
+
+/*
+ * Number of leading full key bytes of a stream of `n` values that can be
+ * handed to a pair kernel without over-reading the end of the data.
+ * The key bytes are walked backward until at least 16 data bytes are left
+ * behind, so this does not rely on the caller padding the input.
+ */
+static inline size_t vb64_safe_pairs(const uint8_t *key_p, size_t n) {
+  size_t npairs = n / 2, tail = (n & 1) ? vb64_klen[key_p[npairs]] : 0;
+  while (npairs && tail < 16)
+    tail += vb64_klen[key_p[--npairs]];
+  return npairs;
+}
+
+/*
+ * Decode the last values of a stream, whose data is (at most 31 bytes) copied
+ * to a local buffer so that the pair kernel can over-read it freely.
+ */
+static const uint8_t *vb64_decode_tail(const uint8_t *key_p,
+                                       const uint8_t *data_p, uint64_t *o,
+                                       size_t n) {
+  size_t npairs = n / 2, tail = 0;
+  for (size_t i = 0; i < npairs; ++i)
+    tail += vb64_klen[key_p[i]];
+  if (n & 1)
+    tail += vb64_klen[key_p[npairs] & 0xF];
+
+  uint8_t buf[32 + 16] = {0};
+  memcpy(buf, data_p, tail);
+  const uint8_t *buf_p = vb64_dec_pairs(key_p, buf, o, npairs);
+  if (n & 1)
+    o[n - 1] = vb64_bdec(&buf_p, key_p[npairs] & 0xF);
+  return data_p + tail;
+}
 
-    *o++ = vb64_bdec(&data_p, (key >> shift_) & 0xF);
-    shift_ += 4;
+// `prev` is the value preceding the first decoded one, 0 for a full stream,
+// `scan` accumulates the deltas
+static inline const uint8_t *
+vb64_decode_scan_(const uint8_t *key_p, const uint8_t *data_p, uint64_t *o,
+                  size_t n, uint64_t prev, vb64_scan_fn scan) {
+  size_t safe = vb64_safe_pairs(key_p, n);
+
+  // the deltas are unpacked one cache resident block at the time, then
+  // accumulated while still hot
+  for (size_t i = 0; i < safe; i += VBYTE64_BLOCK_PAIRS) {
+    size_t m = safe - i < VBYTE64_BLOCK_PAIRS ? safe - i : VBYTE64_BLOCK_PAIRS;
+    uint64_t *ob = o + 2 * i;
+    data_p = vb64_dec_pairs(key_p + i, data_p, ob, m);
+    prev = scan(ob, 2 * m, prev);
   }
 
+  uint64_t *ob = o + 2 * safe;
+  data_p = vb64_decode_tail(key_p + safe, data_p, ob, n - 2 * safe);
+  scan(ob, n - 2 * safe, prev);
+
   return data_p;
 }
 
+static const uint8_t *vb64_decode_delta_base(const uint8_t *key_p,
+                                             const uint8_t *data_p,
+                                             uint64_t *o, size_t n,
+                                             uint64_t prev) {
+  return vb64_decode_scan_(key_p, data_p, o, n, prev, vb64_scan);
+}
+
+// deltas mapped by zigzag, see `vb64_encode_zdelta_base`
+static const uint8_t *vb64_decode_zdelta_base(const uint8_t *key_p,
+                                              const uint8_t *data_p,
+                                              uint64_t *o, size_t n,
+                                              uint64_t prev) {
+  return vb64_decode_scan_(key_p, data_p, o, n, prev, vb64_zscan);
+}
+
+static const uint8_t *vb64_decode_delta(const uint8_t *key_p,
+                                        const uint8_t *data_p, uint64_t *o,
+                                        size_t n) {
+  return vb64_decode_delta_base(key_p, data_p, o, n, 0);
+}
+
+static const uint8_t *vb64_decode(const uint8_t *key_p, const uint8_t *data_p,
+                                  uint64_t *o, size_t n) {
+  size_t safe = vb64_safe_pairs(key_p, n);
+  data_p = vb64_dec_pairs(key_p, data_p, o, safe);
+  return vb64_decode_tail(key_p + safe, data_p, o + 2 * safe, n - 2 * safe);
+}
+
+static const uint8_t *vb64_decode_mode(const uint8_t *key_p,
+                                       const uint8_t *data_p, uint64_t *o,
+                                       size_t n, int mode) {
+  if (mode == vb64_zdelta)
+    return vb64_decode_zdelta_base(key_p, data_p, o, n, 0);
+  if (mode == vb64_delta)
+    return vb64_decode_delta(key_p, data_p, o, n);
+  return vb64_decode(key_p, data_p, o, n);
+}
+
 void vb64_decompress_delta(uint8_t *in, uint64_t *out, size_t n) {
   size_t key_size = sizeof(uint8_t) * ((n + 1) / 2);
   uint8_t *key_p = in;
@@ -359,7 +1248,7 @@ void vb64_decompress(uint8_t *in, uint64_t *out, size_t n) {
 
 uint64_t *vb64_decompress_delta_wl(uint8_t *in, size_t *n) {
   memcpy(n, in, sizeof(size_t));
-  uint64_t *out = malloc(sizeof(out[0]) * *n);
+  uint64_t *out = vb64_malloc(sizeof(out[0]) * *n);
   if (!out)
     return NULL;
   size_t key_size = sizeof(uint8_t) * ((*n + 1) / 2);
@@ -370,9 +1259,35 @@ uint64_t *vb64_decompress_delta_wl(uint8_t *in, size_t *n) {
   return out;
 }
 
+uint64_t *vb64_decompress_delta_wl_into(uint8_t *in, size_t *n, uint64_t *out,
+                                       size_t cap) {
+  memcpy(n, in, sizeof(size_t));
+  if (*n > cap)
+    return NULL;
+  size_t key_size = sizeof(uint8_t) * ((*n + 1) / 2);
+  uint8_t *key_p = in + sizeof(size_t);
+  uint8_t *data_p = key_p + key_size;
+
+  vb64_decode_delta(key_p, data_p, out, *n);
+  return out;
+}
+
+uint64_t *vb64_decompress_wl_into(uint8_t *in, size_t *n, uint64_t *out,
+                                 size_t cap) {
+  memcpy(n, in, sizeof(size_t));
+  if (*n > cap)
+    return NULL;
+  size_t key_size = sizeof(uint8_t) * ((*n + 1) / 2);
+  uint8_t *key_p = in + sizeof(size_t);
+  uint8_t *data_p = key_p + key_size;
+
+  vb64_decode(key_p, data_p, out, *n);
+  return out;
+}
+
 uint64_t *vb64_decompress_wl(uint8_t *in, size_t *n) {
   memcpy(n, in, sizeof(size_t));
-  uint64_t *out = malloc(sizeof(out[0]) * *n);
+  uint64_t *out = vb64_malloc(sizeof(out[0]) * *n);
   if (!out)
     return NULL;
   size_t key_size = sizeof(uint8_t) * ((*n + 1) / 2);
@@ -383,211 +1298,2512 @@ uint64_t *vb64_decompress_wl(uint8_t *in, size_t *n) {
   return out;
 }
 
-// Compression using files directly
-
-enum vb64f_state {
-  vb64f_ok = 0,
-  vb64f_rerr,
-  vb64f_werr,
-};
+void vb64_decompress_zdelta(uint8_t *in, uint64_t *out, size_t n) {
+  size_t key_size = sizeof(uint8_t) * ((n + 1) / 2);
+  vb64_decode_zdelta_base(in, in + key_size, out, n, 0);
+}
 
-static inline uint8_t vb64f_benc_noclz(uint64_t v, FILE *cf_data,
-                                       jmp_buf jmp_target) {
-  uint8_t code = 9;
-  if (v == 0) {
+uint64_t *vb64_decompress_zdelta_wl(uint8_t *in, size_t *n) {
+  memcpy(n, in, sizeof(size_t));
+  uint64_t *out = vb64_malloc(sizeof(out[0]) * *n);
+  if (!out)
+    return NULL;
+  size_t key_size = sizeof(uint8_t) * ((*n + 1) / 2);
+  uint8_t *key_p = in + sizeof(size_t);
+
+  vb64_decode_zdelta_base(key_p, key_p + key_size, out, *n, 0);
+  return out;
+}
+
+// Aggregates: the values are unpacked one cache resident block at the time in
+// a stack buffer and folded while still hot, the output array is never written
+struct vb64_agg {
+  uint64_t sum, min, max, lo, hi;
+  size_t count;
+};
+
+typedef void (*vb64_fold_fn)(struct vb64_agg *acc, const uint64_t *v,
+                             size_t n);
+
+static void vb64_fold_sum(struct vb64_agg *acc, const uint64_t *v, size_t n) {
+  uint64_t s = 0;
+  for (size_t i = 0; i < n; ++i)
+    s += v[i];
+  acc->sum += s;
+}
+
+static void vb64_fold_minmax(struct vb64_agg *acc, const uint64_t *v,
+                             size_t n) {
+  uint64_t lo = acc->min, hi = acc->max;
+  for (size_t i = 0; i < n; ++i) {
+    lo = v[i] < lo ? v[i] : lo;
+    hi = v[i] > hi ? v[i] : hi;
+  }
+  acc->min = lo;
+  acc->max = hi;
+}
+
+// `v - lo < hi - lo` is `lo <= v < hi` for `lo < hi`, in a single compare
+static void vb64_fold_range(struct vb64_agg *acc, const uint64_t *v,
+                            size_t n) {
+  uint64_t lo = acc->lo, width = acc->hi - acc->lo;
+  size_t c = 0;
+  for (size_t i = 0; i < n; ++i)
+    c += v[i] - lo < width;
+  acc->count += c;
+}
+
+static inline __attribute__((always_inline)) void
+vb64_aggregate_(const uint8_t *in, size_t n, int delta, vb64_fold_fn fold,
+                struct vb64_agg *acc) {
+  const uint8_t *key_p = in, *data_p = in + (n + 1) / 2;
+  uint64_t buf[2 * VBYTE64_BLOCK_PAIRS], prev = 0;
+  size_t safe = vb64_safe_pairs(key_p, n);
+
+  // the values past `safe` go through the tail decoder, still one block at
+  // the time as a run of zeros takes no data bytes
+  for (size_t i = 0, m; i < n; i += m) {
+    if (i / 2 < safe) {
+      m = safe - i / 2 < VBYTE64_BLOCK_PAIRS ? safe - i / 2
+                                             : VBYTE64_BLOCK_PAIRS;
+      data_p = vb64_dec_pairs(key_p + i / 2, data_p, buf, m);
+      m *= 2;
+    } else {
+      m = n - i < 2 * VBYTE64_BLOCK_PAIRS ? n - i : 2 * VBYTE64_BLOCK_PAIRS;
+      data_p = vb64_decode_tail(key_p + i / 2, data_p, buf, m);
+    }
+    if (delta)
+      prev = vb64_scan(buf, m, prev);
+    fold(acc, buf, m);
+  }
+}
+
+uint64_t vb64_sum(uint8_t *in, size_t n) {
+  struct vb64_agg acc = {0};
+  vb64_aggregate_(in, n, 0, vb64_fold_sum, &acc);
+  return acc.sum;
+}
+
+uint64_t vb64_sum_delta(uint8_t *in, size_t n) {
+  struct vb64_agg acc = {0};
+  vb64_aggregate_(in, n, 1, vb64_fold_sum, &acc);
+  return acc.sum;
+}
+
+void vb64_minmax(uint8_t *in, size_t n, uint64_t *min, uint64_t *max) {
+  struct vb64_agg acc = {.min = UINT64_MAX};
+  vb64_aggregate_(in, n, 0, vb64_fold_minmax, &acc);
+  *min = acc.min;
+  *max = acc.max;
+}
+
+void vb64_minmax_delta(uint8_t *in, size_t n, uint64_t *min, uint64_t *max) {
+  struct vb64_agg acc = {.min = UINT64_MAX};
+  vb64_aggregate_(in, n, 1, vb64_fold_minmax, &acc);
+  *min = acc.min;
+  *max = acc.max;
+}
+
+size_t vb64_count_range(uint8_t *in, size_t n, uint64_t lo, uint64_t hi) {
+  struct vb64_agg acc = {.lo = lo, .hi = hi};
+  if (lo >= hi)
     return 0;
-  } else if (v < (1UL << 8)) {
-    code = 1; // 1 byte
-  } else if (v < (1UL << 16)) {
-    code = 2; // 2 bytes
-  } else if (v < (1UL << 24)) {
-    code = 3; // 3 bytes
-  } else if (v < (1UL << 32)) {
-    code = 4; // 4 bytes
-  } else if (v < (1UL << 40)) {
-    code = 5; // 5 bytes
-  } else if (v < (1UL << 48)) {
-    code = 6; // 6 bytes
-  } else if (v < (1UL << 56)) {
-    code = 7; // 7 bytes
+  vb64_aggregate_(in, n, 0, vb64_fold_range, &acc);
+  return acc.count;
+}
+
+size_t vb64_count_range_delta(uint8_t *in, size_t n, uint64_t lo,
+                              uint64_t hi) {
+  struct vb64_agg acc = {.lo = lo, .hi = hi};
+  if (lo >= hi)
+    return 0;
+  vb64_aggregate_(in, n, 1, vb64_fold_range, &acc);
+  return acc.count;
+}
+
+// Narrow widths: the same streams for 32 and 16-bit elements, with shorter
+// codes, generated from vbyte64_width.h
+
+#define VBW_WIDTH 32
+#define VBW_TYPE uint32_t
+#define VBW_CODE_BITS 2
+#include "vbyte64_width.h"
+
+#define VBW_WIDTH 16
+#define VBW_TYPE uint16_t
+#define VBW_CODE_BITS 1
+#include "vbyte64_width.h"
+
+// Blocked format: the same key and data streams, preceded by a skip index
+
+// Modes of a stream, and of the blocks of an adaptive stream: frame of
+// reference blocks store the values minus the smallest one, constant blocks
+// store no data.
+enum vb64b_mode {
+  vb64b_plain = 0,
+  vb64b_delta,
+  vb64b_for,
+  vb64b_const,
+  vb64b_adaptive,
+};
+
+// the top byte of a data offset holds the mode of an adaptive block
+#define VBYTE64_BMODE_SHIFT 56
+
+#define VBYTE64_BHEAD_SIZE (sizeof(size_t) + 2 * sizeof(uint32_t))
+#define VBYTE64_BENTRY_SIZE (2 * sizeof(uint64_t))
+
+struct vb64b_view {
+  size_t n, nb;
+  uint32_t bsize, mode;
+  const uint8_t *index, *key_p, *data_p;
+};
+
+static void vb64b_view(const uint8_t *in, struct vb64b_view *b) {
+  memcpy(&b->n, in, sizeof(size_t));
+  memcpy(&b->bsize, in + sizeof(size_t), sizeof(uint32_t));
+  memcpy(&b->mode, in + sizeof(size_t) + sizeof(uint32_t), sizeof(uint32_t));
+  b->nb = (b->n + b->bsize - 1) / b->bsize;
+  b->index = in + VBYTE64_BHEAD_SIZE;
+  b->key_p = b->index + b->nb * VBYTE64_BENTRY_SIZE;
+  b->data_p = b->key_p + (b->n + 1) / 2;
+}
+
+// data offset and base of block `i`, returns its mode.
+// The base is the value preceding the block in a delta stream, and in an
+// adaptive stream the first value (delta blocks), the smallest value (frame
+// of reference) or the only value (constant) of the block.
+static inline int vb64b_entry(const struct vb64b_view *b, size_t i,
+                              uint64_t *offset, uint64_t *base) {
+  memcpy(offset, b->index + i * VBYTE64_BENTRY_SIZE, sizeof(uint64_t));
+  memcpy(base, b->index + i * VBYTE64_BENTRY_SIZE + sizeof(uint64_t),
+         sizeof(uint64_t));
+  if (b->mode != vb64b_adaptive)
+    return b->mode;
+  int mode = *offset >> VBYTE64_BMODE_SHIFT;
+  *offset &= ((uint64_t)1 << VBYTE64_BMODE_SHIFT) - 1;
+  return mode;
+}
+
+/*
+ * Mode of an adaptive block `v` of `m` values using the fewest data bytes,
+ * all modes needing the same keys. `size` is set to that number of bytes and
+ * `base` to the base of the block.
+ */
+static int vb64b_choose(const uint64_t *v, size_t m, uint64_t *base,
+                        size_t *size) {
+  uint64_t min = v[0], max = v[0];
+  for (size_t i = 1; i < m; ++i) {
+    min = v[i] < min ? v[i] : min;
+    max = v[i] > max ? v[i] : max;
+  }
+  *base = min;
+  *size = 0;
+  if (min == max)
+    return vb64b_const;
+
+  int mode = vb64b_plain;
+  size_t plain_size = vb64_encode_size(v, m), for_size = 0;
+  for (size_t i = 0; i < m; ++i)
+    for_size += v[i] - min ? 8U - (__builtin_clzll((v[i] - min) | 1) >> 3) : 0;
+  // a delta block starts from its first value, that takes no data
+  size_t delta_size = vb64d_encode_size(v, m) - vb64_encode_size(v, 1);
+
+  *size = plain_size;
+  *base = 0;
+  if (for_size < *size) {
+    mode = vb64b_for;
+    *size = for_size;
+    *base = min;
+  }
+  if (delta_size < *size) {
+    mode = vb64b_delta;
+    *size = delta_size;
+    *base = v[0];
+  }
+  return mode;
+}
+
+static uint8_t *vb64b_compress_(uint64_t *v, size_t n, size_t *clen,
+                                uint32_t mode) {
+  const uint32_t bsize = VBYTE64_BLOCK_SIZE;
+  size_t nb = (n + bsize - 1) / bsize;
+  size_t key_size = VBYTE64_BHEAD_SIZE + nb * VBYTE64_BENTRY_SIZE +
+                    sizeof(uint8_t) * ((n + 1) / 2);
+  size_t data_size = 0;
+
+  // the mode and base of every adaptive block, chosen before the allocation
+  uint8_t *modes = NULL;
+  uint64_t *bases = NULL;
+  if (mode == vb64b_adaptive) {
+    modes = malloc(sizeof(modes[0]) * nb);
+    bases = malloc(sizeof(bases[0]) * nb);
+    if (!modes || !bases) {
+      free(modes);
+      free(bases);
+      return NULL;
+    }
+    for (size_t i = 0; i < nb; ++i) {
+      size_t lo = i * bsize, m = n - lo < bsize ? n - lo : bsize, size;
+      modes[i] = vb64b_choose(v + lo, m, &bases[i], &size);
+      data_size += size;
+    }
   } else {
-    code = 8; // 8 bytes
+    data_size =
+        mode == vb64b_delta ? vb64d_encode_size(v, n) : vb64_encode_size(v, n);
+  }
+  size_t compress_size = key_size + data_size + VBYTE64_PADDING;
+
+  uint8_t *cdata = (uint8_t *)vb64_malloc(compress_size);
+  if (!cdata) {
+    free(modes);
+    free(bases);
+    return NULL;
   }
-  if (fwrite(&v, sizeof(uint8_t) * code, 1, cf_data) != 1) {
-    longjmp(jmp_target, vb64f_werr);
+  memcpy(cdata, &n, sizeof(size_t));
+  memcpy(cdata + sizeof(size_t), &bsize, sizeof(uint32_t));
+  memcpy(cdata + sizeof(size_t) + sizeof(uint32_t), &mode, sizeof(uint32_t));
+
+  uint8_t *index_p = cdata + VBYTE64_BHEAD_SIZE;
+  uint8_t *key_p = index_p + nb * VBYTE64_BENTRY_SIZE;
+  uint8_t *data_start = cdata + key_size, *data_p = data_start;
+
+  for (size_t i = 0; i < nb; ++i) {
+    size_t lo = i * bsize, m = n - lo < bsize ? n - lo : bsize;
+    uint64_t offset = data_p - data_start;
+    uint64_t base = mode == vb64b_delta && lo ? v[lo - 1] : 0;
+    int bmode = mode;
+    if (mode == vb64b_adaptive) {
+      bmode = modes[i];
+      base = bases[i];
+      offset |= (uint64_t)bmode << VBYTE64_BMODE_SHIFT;
+    }
+    memcpy(index_p, &offset, sizeof(uint64_t));
+    memcpy(index_p + sizeof(uint64_t), &base, sizeof(uint64_t));
+    index_p += VBYTE64_BENTRY_SIZE;
+
+    if (bmode == vb64b_delta) {
+      data_p = vb64_encode_delta_base(key_p, data_p, v + lo, m, base);
+    } else if (bmode == vb64b_for) {
+      uint64_t shifted[VBYTE64_BLOCK_SIZE];
+      for (size_t j = 0; j < m; ++j)
+        shifted[j] = v[lo + j] - base;
+      data_p = vb64_encode(key_p, data_p, shifted, m);
+    } else if (bmode == vb64b_const) {
+      memset(key_p, 0, sizeof(uint8_t) * ((m + 1) / 2));
+    } else {
+      data_p = vb64_encode(key_p, data_p, v + lo, m);
+    }
+    key_p += m / 2;
   }
-  return code;
+
+  free(modes);
+  free(bases);
+  if (clen)
+    *clen = data_p - cdata;
+  return cdata;
 }
 
-static inline uint8_t vb64f_benc(uint64_t v, FILE *cf_data,
-                                 jmp_buf jmp_target) {
-  if (!v)
-    return 0;
-  uint8_t code = 8U - (__builtin_clzll(v | 1) >> 3);
-  if (fwrite(&v, sizeof(uint8_t) * code, 1, cf_data) != 1) {
-    longjmp(jmp_target, vb64f_werr);
+uint8_t *vb64b_compress_delta(uint64_t *v, size_t n, size_t *clen) {
+  return vb64b_compress_(v, n, clen, vb64b_delta);
+}
+
+uint8_t *vb64b_compress(uint64_t *v, size_t n, size_t *clen) {
+  return vb64b_compress_(v, n, clen, vb64b_plain);
+}
+
+uint8_t *vb64b_compress_adaptive(uint64_t *v, size_t n, size_t *clen) {
+  return vb64b_compress_(v, n, clen, vb64b_adaptive);
+}
+
+size_t vb64b_len(const uint8_t *in) {
+  size_t n;
+  memcpy(&n, in, sizeof(size_t));
+  return n;
+}
+
+/*
+ * Position the key and data pointers on value `i`, using the skip index to
+ * jump to its block and the key lengths to walk inside of it.
+ * `mode` is set to the mode of the block. In delta mode `prev` is set to the
+ * value preceding `i`, otherwise to the base added to the decoded values.
+ * If `i` is odd its key is shared with the previous value, this one is
+ * decoded here and `i + 1` is positioned instead, the return is then 1.
+ */
+static int vb64b_seek(const struct vb64b_view *b, size_t i,
+                      const uint8_t **key_pp, const uint8_t **data_pp,
+                      uint64_t *prev, uint64_t *o, int *mode) {
+  size_t bi = i / b->bsize, lo = bi * b->bsize;
+  uint64_t offset, base;
+  *mode = vb64b_entry(b, bi, &offset, &base);
+  const uint8_t *key_p = b->key_p + lo / 2, *data_p = b->data_p + offset;
+
+  if (*mode == vb64b_delta) {
+    for (size_t j = lo; j < (i & ~(size_t)1); j += 2) {
+      uint8_t key = *key_p++;
+      base += vb64_bdec(&data_p, key & 0xF);
+      base += vb64_bdec(&data_p, key >> 4);
+    }
+  } else {
+    for (size_t j = lo; j < (i & ~(size_t)1); j += 2)
+      data_p += vb64_klen[*key_p++];
   }
-  return code;
+
+  int odd = i & 1;
+  if (odd) {
+    uint8_t key = *key_p++;
+    uint64_t skipped = vb64_bdec(&data_p, key & 0xF);
+    uint64_t val = vb64_bdec(&data_p, key >> 4);
+    base += *mode == vb64b_delta ? skipped + val : 0;
+    *o = *mode == vb64b_delta ? base : val + base;
+  }
+  *key_pp = key_p;
+  *data_pp = data_p;
+  *prev = base;
+  return odd;
 }
 
-size_t vb64f_encode_delta(FILE *cf_key, FILE *cf_data, const uint64_t *v,
-                          size_t n, jmp_buf jmp_target) {
-  size_t nbytes = 0;
-  uint8_t shift_ = 0, ckey = 0, code = 0;
-  uint64_t ov = v[0], cv;
-  // first one must be encoded fully
-#ifdef VBYTE64_NO_CLZ
-  code = vb64f_benc_noclz(v[0], cf_data, jmp_target);
-#else
-  code = vb64f_benc(v[0], cf_data, jmp_target);
-#endif /* ifdef VBYTE64_NO_CLZ */
-  nbytes += code;
+static size_t vb64b_range_(const struct vb64b_view *b, size_t lo, size_t hi,
+                           uint64_t *out) {
+  if (hi > b->n)
+    hi = b->n;
+  if (lo >= hi)
+    return 0;
 
-  ckey |= code << shift_;
-  shift_ += 4;
+  const uint8_t *key_p, *data_p;
+  uint64_t prev;
+  int mode;
+  if (b->mode != vb64b_adaptive) {
+    int odd = vb64b_seek(b, lo, &key_p, &data_p, &prev, out, &mode);
+    // the streams are contiguous across blocks, decode the rest in one go
+    if (mode == vb64b_delta)
+      vb64_decode_delta_base(key_p, data_p, out + odd, hi - lo - odd, prev);
+    else
+      vb64_decode(key_p, data_p, out + odd, hi - lo - odd);
+    return hi - lo;
+  }
 
-  for (size_t i = 1; i < n; i++) {
-    if (shift_ == 8) {
-      shift_ = 0;
-      if (fwrite(&ckey, sizeof(uint8_t), 1, cf_key) != 1) {
-        longjmp(jmp_target, vb64f_werr);
-      }
-      ckey = 0;
-      ++nbytes;
+  // one block at the time, each with its own mode
+  for (size_t i = lo; i < hi;) {
+    size_t end = (i / b->bsize + 1) * b->bsize;
+    end = end < hi ? end : hi;
+    int odd = vb64b_seek(b, i, &key_p, &data_p, &prev, out + i - lo, &mode);
+    uint64_t *o = out + i - lo + odd;
+    size_t m = end - i - odd;
+    if (mode == vb64b_delta) {
+      vb64_decode_delta_base(key_p, data_p, o, m, prev);
+    } else if (mode == vb64b_const) {
+      for (size_t j = 0; j < m; ++j)
+        o[j] = prev;
+    } else {
+      vb64_decode(key_p, data_p, o, m);
+      for (size_t j = 0; prev && j < m; ++j)
+        o[j] += prev;
     }
-    cv = v[i];
-#ifdef VBYTE64_NO_CLZ
-    code = vb64f_benc_noclz(cv - ov, cf_data, jmp_target);
-#else
-    code = vb64f_benc(cv - ov, cf_data, jmp_target);
-#endif /* ifdef VBYTE64_NO_CLZ */
-    nbytes += code;
-    ckey |= code << shift_;
-    shift_ += 4;
-    ov = cv;
+    i = end;
+  }
+  return hi - lo;
+}
+
+size_t vb64b_decode_range(const uint8_t *in, size_t lo, size_t hi,
+                          uint64_t *out) {
+  struct vb64b_view b;
+  vb64b_view(in, &b);
+  return vb64b_range_(&b, lo, hi, out);
+}
+
+uint64_t vb64b_get(const uint8_t *in, size_t i) {
+  uint64_t val = 0;
+  vb64b_decode_range(in, i, i + 1, &val);
+  return val;
+}
+
+size_t vb64b_lower_bound(const uint8_t *in, uint64_t x, uint64_t *val) {
+  struct vb64b_view b;
+  vb64b_view(in, &b);
+  // only delta streams have the prefix values as block bases, the blocks of
+  // an adaptive stream each have their own kind of base
+  if (b.n == 0 || b.mode != vb64b_delta)
+    return b.n;
+
+  // the base of block i is the last value of block i - 1, find the first
+  // block whose predecessor reaches `x`, the answer lies right before it
+  size_t l = 1, r = b.nb;
+  uint64_t offset, base;
+  while (l < r) {
+    size_t mid = l + (r - l) / 2;
+    vb64b_entry(&b, mid, &offset, &base);
+    if (base < x)
+      l = mid + 1;
+    else
+      r = mid;
   }
-  if (fwrite(&ckey, sizeof(uint8_t), 1, cf_key) != 1) {
-    longjmp(jmp_target, vb64f_werr);
+  size_t bi = l - 1, i = bi * b.bsize, end = i + b.bsize;
+  if (end > b.n)
+    end = b.n;
+
+  // decode the candidate block only as far as needed
+  vb64b_entry(&b, bi, &offset, &base);
+  const uint8_t *data_p = b.data_p + offset;
+  for (; i < end; ++i) {
+    base += vb64_bdec(&data_p, (b.key_p[i / 2] >> (4 * (i & 1))) & 0xF);
+    if (base >= x) {
+      if (val)
+        *val = base;
+      return i;
+    }
   }
-  return ++nbytes;
+  return b.n;
 }
 
-size_t vb64f_compress_delta(uint64_t *v, size_t n, const char *fpath) {
-  size_t key_size = sizeof(size_t) + sizeof(uint8_t) * ((n + 1) / 2),
-         nbytes = 0;
+uint64_t *vb64b_decompress(uint8_t *in, size_t *n) {
+  struct vb64b_view b;
+  vb64b_view(in, &b);
+  *n = b.n;
+  uint64_t *out = vb64_malloc(sizeof(out[0]) * b.n);
+  if (!out)
+    return NULL;
+  if (b.mode == vb64b_adaptive)
+    vb64b_range_(&b, 0, b.n, out);
+  else if (b.mode == vb64b_delta)
+    vb64_decode_delta(b.key_p, b.data_p, out, b.n);
+  else
+    vb64_decode(b.key_p, b.data_p, out, b.n);
+  return out;
+}
+
+// Set operations on sorted blocked streams
+
+// Forward only iterator, decoding one chunk of values at the time
+struct vb64b_cursor {
+  struct vb64b_view b;
+  size_t i, pos, len; // index of buf[0], current position, decoded values
+  uint64_t buf[VBYTE64_BLOCK_SIZE];
+};
+
+static void vb64b_cursor_load(struct vb64b_cursor *c, size_t s) {
+  c->i = s;
+  c->pos = 0;
+  c->len = vb64b_range_(&c->b, s, s + VBYTE64_BLOCK_SIZE, c->buf);
+}
+
+static void vb64b_cursor_init(struct vb64b_cursor *c, const uint8_t *in) {
+  vb64b_view(in, &c->b);
+  vb64b_cursor_load(c, 0);
+}
+
+static inline int vb64b_cursor_valid(const struct vb64b_cursor *c) {
+  return c->pos < c->len;
+}
+
+static inline void vb64b_cursor_next(struct vb64b_cursor *c) {
+  if (++c->pos == c->len && c->i + c->len < c->b.n)
+    vb64b_cursor_load(c, c->i + c->len);
+}
+
+// move to the first value not smaller than `x`, never backward
+static void vb64b_cursor_seek(struct vb64b_cursor *c, uint64_t x) {
+  if (!vb64b_cursor_valid(c) || c->buf[c->pos] >= x)
+    return;
+
+  while (c->buf[c->len - 1] < x) {
+    size_t end = c->i + c->len;
+    if (end >= c->b.n) {
+      c->pos = c->len;
+      return;
+    }
+    // only the bases of a delta stream are the values preceding the blocks,
+    // the other modes are walked one chunk at the time
+    if (c->b.mode != vb64b_delta) {
+      vb64b_cursor_load(c, end);
+      continue;
+    }
+    // gallop on the skip index, looking for the first block past the
+    // loaded values whose predecessor reaches `x`
+    size_t lo = end / c->b.bsize + 1, hi = lo, step = 1;
+    uint64_t offset, base;
+    while (hi < c->b.nb) {
+      vb64b_entry(&c->b, hi, &offset, &base);
+      if (base >= x)
+        break;
+      lo = hi + 1;
+      hi += step;
+      step *= 2;
+    }
+    if (hi > c->b.nb)
+      hi = c->b.nb;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      vb64b_entry(&c->b, mid, &offset, &base);
+      if (base < x)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    size_t s = (lo - 1) * c->b.bsize;
+    vb64b_cursor_load(c, s > end ? s : end);
+  }
+
+  size_t lo = c->pos, hi = c->len - 1;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (c->buf[mid] < x)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  c->pos = lo;
+}
 
-  FILE *cf_key = fopen(fpath, "wb");
-  FILE *cf_data = fopen(fpath, "r+b");
+// Incremental writer of a blocked delta stream, of at most `cap_n` values
+struct vb64b_writer {
+  uint8_t *cdata, *index_p, *key_p, *data_start, *data_p;
+  size_t n, cap_n, m;
+  uint64_t prev;
+  uint64_t buf[VBYTE64_BLOCK_SIZE];
+};
 
-  if (!cf_key || !cf_data)
+static int vb64b_writer_init(struct vb64b_writer *w, size_t cap_n) {
+  size_t nb = (cap_n + VBYTE64_BLOCK_SIZE - 1) / VBYTE64_BLOCK_SIZE;
+  // keys and data are written at their worst case position, then moved
+  // down when the final length is known
+  size_t key_size = VBYTE64_BHEAD_SIZE + nb * VBYTE64_BENTRY_SIZE +
+                    sizeof(uint8_t) * ((cap_n + 1) / 2);
+  w->cdata = (uint8_t *)vb64_malloc(key_size + sizeof(uint64_t) * cap_n +
+                                    VBYTE64_PADDING);
+  if (!w->cdata)
     return 0;
+  w->index_p = w->cdata + VBYTE64_BHEAD_SIZE;
+  w->key_p = w->index_p + nb * VBYTE64_BENTRY_SIZE;
+  w->data_start = w->data_p = w->cdata + key_size;
+  w->n = w->m = w->prev = 0;
+  w->cap_n = cap_n;
+  return 1;
+}
 
-  jmp_buf jmp_target;
+static void vb64b_writer_flush(struct vb64b_writer *w) {
+  uint64_t offset = w->data_p - w->data_start;
+  memcpy(w->index_p, &offset, sizeof(uint64_t));
+  memcpy(w->index_p + sizeof(uint64_t), &w->prev, sizeof(uint64_t));
+  w->index_p += VBYTE64_BENTRY_SIZE;
+
+  w->data_p = vb64_encode_delta_base(w->key_p, w->data_p, w->buf, w->m,
+                                     w->prev);
+  w->key_p += w->m / 2;
+  w->prev = w->buf[w->m - 1];
+  w->n += w->m;
+  w->m = 0;
+}
 
-  switch (setjmp(jmp_target)) {
-  case 0:
-    break;
-  case vb64f_werr:
-    fprintf(stderr, "[%s] ERROR: fwrite failed, exit.\n", __func__);
-    nbytes = 0;
-    goto clean;
-  default:
-    fprintf(stderr, "[%s] An unknown error have occurred, exit.\n", __func__);
-    exit(EXIT_FAILURE);
+static inline void vb64b_writer_push(struct vb64b_writer *w, uint64_t x) {
+  w->buf[w->m++] = x;
+  if (w->m == VBYTE64_BLOCK_SIZE)
+    vb64b_writer_flush(w);
+}
+
+static uint8_t *vb64b_writer_finish(struct vb64b_writer *w, size_t *clen) {
+  if (w->m)
+    vb64b_writer_flush(w);
+  const uint32_t bsize = VBYTE64_BLOCK_SIZE, mode = vb64b_delta;
+  memcpy(w->cdata, &w->n, sizeof(size_t));
+  memcpy(w->cdata + sizeof(size_t), &bsize, sizeof(uint32_t));
+  memcpy(w->cdata + sizeof(size_t) + sizeof(uint32_t), &mode,
+         sizeof(uint32_t));
+
+  struct vb64b_view b;
+  vb64b_view(w->cdata, &b);
+  size_t key_size = (w->n + 1) / 2, data_size = w->data_p - w->data_start;
+  // a trailing odd value has its key byte past the written ones
+  memmove((uint8_t *)b.key_p, w->key_p - w->n / 2, key_size);
+  memmove((uint8_t *)b.data_p, w->data_start, data_size);
+
+  size_t used = b.data_p + data_size - w->cdata;
+  if (clen)
+    *clen = used;
+  return (uint8_t *)vb64_shrink(w->cdata, used + VBYTE64_PADDING);
+}
+
+enum vb64b_setop {
+  vb64b_intersect_op = 0,
+  vb64b_union_op,
+};
+
+static size_t vb64b_setop_(const uint8_t *a_in, const uint8_t *b_in, int op,
+                           uint64_t *out, struct vb64b_writer *w) {
+  struct vb64b_cursor cursors[2], *a = cursors, *b = cursors + 1;
+  vb64b_cursor_init(a, a_in);
+  vb64b_cursor_init(b, b_in);
+
+  size_t n = 0;
+#define VBYTE64_EMIT(x)                                                        \
+  do {                                                                         \
+    if (w)                                                                     \
+      vb64b_writer_push(w, (x));                                               \
+    else                                                                       \
+      out[n] = (x);                                                            \
+    ++n;                                                                       \
+  } while (0)
+
+  while (vb64b_cursor_valid(a) && vb64b_cursor_valid(b)) {
+    uint64_t va = a->buf[a->pos], vb = b->buf[b->pos];
+    if (va == vb) {
+      VBYTE64_EMIT(va);
+      vb64b_cursor_next(a);
+      vb64b_cursor_next(b);
+    } else if (op == vb64b_intersect_op) {
+      // skip whole blocks of the list lagging behind
+      if (va < vb)
+        vb64b_cursor_seek(a, vb);
+      else
+        vb64b_cursor_seek(b, va);
+    } else if (va < vb) {
+      VBYTE64_EMIT(va);
+      vb64b_cursor_next(a);
+    } else {
+      VBYTE64_EMIT(vb);
+      vb64b_cursor_next(b);
+    }
   }
-  // copy size to the first bytes
-  if (fwrite(&n, sizeof(size_t), 1, cf_key) != 1) {
-    longjmp(jmp_target, vb64f_werr);
+  if (op == vb64b_union_op) {
+    struct vb64b_cursor *rest = vb64b_cursor_valid(a) ? a : b;
+    for (; vb64b_cursor_valid(rest); vb64b_cursor_next(rest))
+      VBYTE64_EMIT(rest->buf[rest->pos]);
   }
+#undef VBYTE64_EMIT
 
-  fseek(cf_data, key_size, SEEK_SET);
-  nbytes =
-      vb64f_encode_delta(cf_key, cf_data, v, n, jmp_target) + sizeof(size_t);
+  return n;
+}
 
-clean:
-  fclose(cf_data);
-  fclose(cf_key);
-  return nbytes;
+size_t vb64b_intersect(const uint8_t *a, const uint8_t *b, uint64_t *out) {
+  return vb64b_setop_(a, b, vb64b_intersect_op, out, NULL);
 }
 
-// DECODE
-static inline uint64_t vb64f_bdec(FILE *cf_data, uint8_t code,
-                                  jmp_buf jmp_target) {
-  if (code == 0)
-    return 0;
+size_t vb64b_union(const uint8_t *a, const uint8_t *b, uint64_t *out) {
+  return vb64b_setop_(a, b, vb64b_union_op, out, NULL);
+}
 
-  uint64_t val = 0;
-  if (fread(&val, sizeof(uint8_t), code, cf_data) != code) {
-    longjmp(jmp_target, vb64f_rerr);
+uint8_t *vb64b_intersect_delta(const uint8_t *a, const uint8_t *b,
+                               size_t *clen) {
+  size_t na = vb64b_len(a), nb = vb64b_len(b);
+  struct vb64b_writer w;
+  if (!vb64b_writer_init(&w, na < nb ? na : nb))
+    return NULL;
+  vb64b_setop_(a, b, vb64b_intersect_op, NULL, &w);
+  return vb64b_writer_finish(&w, clen);
+}
+
+uint8_t *vb64b_union_delta(const uint8_t *a, const uint8_t *b, size_t *clen) {
+  struct vb64b_writer w;
+  if (!vb64b_writer_init(&w, vb64b_len(a) + vb64b_len(b)))
+    return NULL;
+  vb64b_setop_(a, b, vb64b_union_op, NULL, &w);
+  return vb64b_writer_finish(&w, clen);
+}
+
+// Multithreading
+
+// Values encoded per step by a compression thread, the data goes through a
+// private buffer so that the SIMD stores past its end never reach the chunk
+// of another thread.
+#define VBYTE64_MT_STEP 4096
+// Below this many values per thread the work is not split.
+#define VBYTE64_MT_MIN (1 << 16)
+#define VBYTE64_MT_MAX 1024
+
+struct vb64_mt {
+  uint64_t *v;
+  uint8_t *key_p, *data_p;
+  size_t n, chunk;
+  int nthreads, delta;
+  size_t *offsets; // data size, then data offset, of each chunk
+  uint64_t *carry; // in delta decoding, the last value of each chunk
+  pthread_t *th;
+  struct vb64_mt_arg *args;
+};
+
+struct vb64_mt_arg {
+  struct vb64_mt *mt;
+  void (*fn)(struct vb64_mt *, int);
+  int t, started;
+};
+
+static void *vb64_mt_thread(void *arg) {
+  struct vb64_mt_arg *a = (struct vb64_mt_arg *)arg;
+  a->fn(a->mt, a->t);
+  return NULL;
+}
+
+// run `fn` on every chunk, one thread each, the caller taking the first
+static void vb64_mt_run(struct vb64_mt *mt,
+                        void (*fn)(struct vb64_mt *, int)) {
+  for (int t = 1; t < mt->nthreads; ++t) {
+    struct vb64_mt_arg *a = &mt->args[t];
+    *a = (struct vb64_mt_arg){mt, fn, t, 0};
+    a->started = pthread_create(&mt->th[t], NULL, vb64_mt_thread, a) == 0;
   }
-  return val;
+  fn(mt, 0);
+  for (int t = 1; t < mt->nthreads; ++t) {
+    if (mt->args[t].started)
+      pthread_join(mt->th[t], NULL);
+    else
+      fn(mt, t); // no thread available, do it here
+  }
+}
+
+static void vb64_mt_free(struct vb64_mt *mt) {
+  free(mt->offsets);
+  free(mt->carry);
+  free(mt->th);
+  free(mt->args);
 }
 
-void vb64f_decode_delta(FILE *cf_keys, FILE *cf_data, uint64_t *o, size_t n,
-                        jmp_buf jmp_target) {
-  // first value if fully encoded
-  uint8_t key = 0;
-  if (fread(&key, sizeof(uint8_t), 1, cf_keys) != 1) {
-    longjmp(jmp_target, vb64f_rerr);
+static int vb64_mt_init(struct vb64_mt *mt, uint64_t *v, size_t n,
+                        int nthreads, int delta) {
+  if (nthreads <= 0)
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > VBYTE64_MT_MAX)
+    nthreads = VBYTE64_MT_MAX;
+  if ((size_t)nthreads > n / VBYTE64_MT_MIN)
+    nthreads = (int)(n / VBYTE64_MT_MIN);
+  if (nthreads < 1)
+    nthreads = 1;
+  mt->v = v;
+  mt->n = n;
+  mt->nthreads = nthreads;
+  mt->delta = delta;
+  // chunks start on a key byte
+  mt->chunk = ((n + nthreads - 1) / nthreads + 1) & ~(size_t)1;
+  mt->offsets = malloc(sizeof(size_t) * nthreads);
+  mt->carry = malloc(sizeof(uint64_t) * nthreads);
+  mt->th = malloc(sizeof(pthread_t) * nthreads);
+  mt->args = malloc(sizeof(struct vb64_mt_arg) * nthreads);
+  if (!mt->offsets || !mt->carry || !mt->th || !mt->args) {
+    vb64_mt_free(mt);
+    return 0;
   }
-  uint64_t prev = vb64f_bdec(cf_data, key & 0xF, jmp_target), val = 0;
+  return 1;
+}
 
-  *o++ = prev;
-  uint8_t shift_ = 4;
+static inline void vb64_mt_bounds(const struct vb64_mt *mt, int t, size_t *lo,
+                                  size_t *hi) {
+  *lo = t * mt->chunk < mt->n ? t * mt->chunk : mt->n;
+  *hi = *lo + mt->chunk < mt->n ? *lo + mt->chunk : mt->n;
+}
 
-  for (size_t i = 1; i < n; ++i) {
-    if (shift_ == 8) {
-      shift_ = 0;
-      if (fread(&key, sizeof(uint8_t), 1, cf_keys) != 1) {
-        longjmp(jmp_target, vb64f_rerr);
-      }
-    }
-    val = vb64f_bdec(cf_data, (key >> shift_) & 0xF, jmp_target);
-    val += prev;
-    *o++ = val;
-    prev = val;
-    shift_ += 4;
+// data offset of each chunk from the sizes, returns the total
+static size_t vb64_mt_offsets(struct vb64_mt *mt) {
+  size_t total = 0;
+  for (int t = 0; t < mt->nthreads; ++t) {
+    size_t size = mt->offsets[t];
+    mt->offsets[t] = total;
+    total += size;
   }
+  return total;
 }
 
-uint64_t *vb64f_decompress_delta(const char *fpath, size_t *n) {
-  FILE *cf_keys = fopen(fpath, "rb");
-  FILE *cf_data = fopen(fpath, "rb");
-  uint64_t *out;
+static void vb64_mt_encode_size(struct vb64_mt *mt, int t) {
+  size_t lo, hi, nbytes = 0;
+  vb64_mt_bounds(mt, t, &lo, &hi);
+  uint64_t ov = mt->delta && lo ? mt->v[lo - 1] : 0;
+  for (size_t i = lo; i < hi; ++i) {
+    uint64_t v_ = mt->delta ? mt->v[i] - ov : mt->v[i];
+    nbytes += v_ ? 8U - (__builtin_clzll(v_ | 1) >> 3) : 0;
+    ov = mt->v[i];
+  }
+  mt->offsets[t] = nbytes;
+}
+
+static void vb64_mt_encode(struct vb64_mt *mt, int t) {
+  size_t lo, hi;
+  vb64_mt_bounds(mt, t, &lo, &hi);
+  uint8_t *data_p = mt->data_p + mt->offsets[t];
+  uint8_t *buf = malloc(sizeof(uint64_t) * VBYTE64_MT_STEP + VBYTE64_PADDING);
+  if (!buf) {
+    // the scalar kernel never writes past the data, encode in place
+    uint8_t *key_p = mt->key_p + lo / 2;
+    uint64_t prev = mt->delta && lo ? mt->v[lo - 1] : 0;
+    size_t m = hi - lo;
+    data_p = mt->delta ? vb64_enc_pairs_delta_scalar(key_p, data_p,
+                                                      mt->v + lo, m / 2, prev)
+                       : vb64_enc_pairs_scalar(key_p, data_p, mt->v + lo,
+                                               m / 2, 0);
+    if (m & 1) {
+      uint64_t ov = mt->delta ? (m > 1 ? mt->v[hi - 2] : prev) : 0;
+      key_p[m / 2] = vb64_benc_sel(mt->v[hi - 1] - ov, &data_p);
+    }
+    return;
+  }
+
+  for (size_t i = lo; i < hi; i += VBYTE64_MT_STEP) {
+    size_t m = hi - i < VBYTE64_MT_STEP ? hi - i : VBYTE64_MT_STEP;
+    uint8_t *end = mt->delta ? vb64_encode_delta_base(mt->key_p + i / 2, buf,
+                                                      mt->v + i, m,
+                                                      i ? mt->v[i - 1] : 0)
+                             : vb64_encode(mt->key_p + i / 2, buf, mt->v + i, m);
+    memcpy(data_p, buf, end - buf);
+    data_p += end - buf;
+  }
+  free(buf);
+}
 
-  if (!cf_keys || !cf_data)
+static uint8_t *vb64_compress_mt_(uint64_t *v, size_t n, size_t *clen,
+                                  int nthreads, int wl, int delta) {
+  struct vb64_mt mt;
+  if (!vb64_mt_init(&mt, v, n, nthreads, delta))
+    return NULL;
+  vb64_mt_run(&mt, vb64_mt_encode_size);
+  size_t data_size = vb64_mt_offsets(&mt);
+
+  size_t head_size = wl ? sizeof(size_t) : 0;
+  size_t key_size = head_size + sizeof(uint8_t) * ((n + 1) / 2);
+  uint8_t *cdata =
+      (uint8_t *)vb64_malloc(key_size + data_size + VBYTE64_PADDING);
+  if (!cdata) {
+    vb64_mt_free(&mt);
     return NULL;
+  }
+  if (wl)
+    memcpy(cdata, &n, sizeof(size_t));
+  mt.key_p = cdata + head_size;
+  mt.data_p = cdata + key_size;
+  vb64_mt_run(&mt, vb64_mt_encode);
+  vb64_mt_free(&mt);
+
+  if (clen)
+    *clen = key_size + data_size;
+  return cdata;
+}
+
+uint8_t *vb64_compress_delta_mt(uint64_t *v, size_t n, size_t *clen,
+                                int nthreads) {
+  return vb64_compress_mt_(v, n, clen, nthreads, 0, 1);
+}
 
-  jmp_buf jmp_target;
+uint8_t *vb64_compress_mt(uint64_t *v, size_t n, size_t *clen, int nthreads) {
+  return vb64_compress_mt_(v, n, clen, nthreads, 0, 0);
+}
 
-  switch (setjmp(jmp_target)) {
-  case 0:
-    break;
-  case vb64f_rerr:
-    fprintf(stderr, "[%s] ERROR: fread failed, exit.\n", __func__);
-    out = NULL;
-    goto clean;
-  default:
-    fprintf(stderr, "[%s] An unknown error have occurred, exit.\n", __func__);
-    exit(EXIT_FAILURE);
+uint8_t *vb64_compress_delta_wl_mt(uint64_t *v, size_t n, size_t *clen,
+                                   int nthreads) {
+  return vb64_compress_mt_(v, n, clen, nthreads, 1, 1);
+}
+
+uint8_t *vb64_compress_wl_mt(uint64_t *v, size_t n, size_t *clen,
+                             int nthreads) {
+  return vb64_compress_mt_(v, n, clen, nthreads, 1, 0);
+}
+
+// the chunk offset table is rebuilt from the key lengths alone
+static void vb64_mt_decode_size(struct vb64_mt *mt, int t) {
+  size_t lo, hi, nbytes = 0;
+  vb64_mt_bounds(mt, t, &lo, &hi);
+  for (size_t i = lo / 2; i < (hi + 1) / 2; ++i)
+    nbytes += vb64_klen[mt->key_p[i]];
+  mt->offsets[t] = nbytes;
+}
+
+static void vb64_mt_decode(struct vb64_mt *mt, int t) {
+  size_t lo, hi;
+  vb64_mt_bounds(mt, t, &lo, &hi);
+  const uint8_t *key_p = mt->key_p + lo / 2;
+  const uint8_t *data_p = mt->data_p + mt->offsets[t];
+  if (mt->delta) {
+    // chunks are decoded from 0, fixed up once all the carries are known
+    vb64_decode_delta(key_p, data_p, mt->v + lo, hi - lo);
+    mt->carry[t] = hi > lo ? mt->v[hi - 1] : 0;
+  } else {
+    vb64_decode(key_p, data_p, mt->v + lo, hi - lo);
   }
+}
 
-  if (fread(n, sizeof(size_t), 1, cf_keys) != 1) {
-    longjmp(jmp_target, vb64f_rerr);
+static void vb64_mt_decode_fix(struct vb64_mt *mt, int t) {
+  size_t lo, hi;
+  vb64_mt_bounds(mt, t, &lo, &hi);
+  uint64_t carry = mt->carry[t];
+  if (!carry)
+    return;
+  for (size_t i = lo; i < hi; ++i)
+    mt->v[i] += carry;
+}
+
+static void vb64_decompress_mt_(uint8_t *key_p, uint64_t *out, size_t n,
+                                int nthreads, int delta) {
+  struct vb64_mt mt;
+  if (!vb64_mt_init(&mt, out, n, nthreads, delta)) {
+    // not even the tables could be allocated, go single threaded
+    uint8_t *data_p = key_p + (n + 1) / 2;
+    if (delta)
+      vb64_decode_delta(key_p, data_p, out, n);
+    else
+      vb64_decode(key_p, data_p, out, n);
+    return;
+  }
+  mt.key_p = key_p;
+  mt.data_p = key_p + (n + 1) / 2;
+  vb64_mt_run(&mt, vb64_mt_decode_size);
+  vb64_mt_offsets(&mt);
+  vb64_mt_run(&mt, vb64_mt_decode);
+  if (delta && mt.nthreads > 1) {
+    uint64_t carry = 0;
+    for (int t = 0; t < mt.nthreads; ++t) {
+      uint64_t last = mt.carry[t];
+      mt.carry[t] = carry;
+      carry += last;
+    }
+    vb64_mt_run(&mt, vb64_mt_decode_fix);
   }
+  vb64_mt_free(&mt);
+}
+
+void vb64_decompress_delta_mt(uint8_t *in, uint64_t *out, size_t n,
+                              int nthreads) {
+  vb64_decompress_mt_(in, out, n, nthreads, 1);
+}
+
+void vb64_decompress_mt(uint8_t *in, uint64_t *out, size_t n, int nthreads) {
+  vb64_decompress_mt_(in, out, n, nthreads, 0);
+}
 
-  size_t key_size = sizeof(size_t) + sizeof(uint8_t) * ((*n + 1) / 2);
-  size_t data_offset = key_size;
-  fseek(cf_data, data_offset, SEEK_SET);
-  out = malloc(sizeof(out[0]) * *n);
+uint64_t *vb64_decompress_delta_wl_mt(uint8_t *in, size_t *n, int nthreads) {
+  memcpy(n, in, sizeof(size_t));
+  uint64_t *out = vb64_malloc(sizeof(out[0]) * *n);
+  if (!out)
+    return NULL;
+  vb64_decompress_mt_(in + sizeof(size_t), out, *n, nthreads, 1);
+  return out;
+}
 
+uint64_t *vb64_decompress_wl_mt(uint8_t *in, size_t *n, int nthreads) {
+  memcpy(n, in, sizeof(size_t));
+  uint64_t *out = vb64_malloc(sizeof(out[0]) * *n);
   if (!out)
     return NULL;
+  vb64_decompress_mt_(in + sizeof(size_t), out, *n, nthreads, 0);
+  return out;
+}
+
+// Compression using files directly
+
+// Values encoded per write by the file writer, the keys and the data of each
+// step are buffered and written with one `pwrite` each.
+#define VBYTE64_FILE_STEP (1 << 16)
+
+static int vb64f_pwrite_all(int fd, const void *buf, size_t len, off_t off) {
+  const uint8_t *p = (const uint8_t *)buf;
+  while (len) {
+    ssize_t w = pwrite(fd, p, len, off);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return 0;
+    }
+    p += w;
+    len -= w;
+    off += w;
+  }
+  return 1;
+}
+
+/*
+ * Write the `_wl` layout of `v` to `fd` starting at `off`, without moving
+ * the file offset. Returns the number of bytes written, 0 on failure.
+ */
+static size_t vb64f_write_(int fd, off_t off, const uint64_t *v, size_t n,
+                           int mode) {
+  size_t step = n < VBYTE64_FILE_STEP ? n : VBYTE64_FILE_STEP;
+  uint8_t *key_buf = malloc(sizeof(uint8_t) * ((step + 1) / 2));
+  uint8_t *data_buf = malloc(sizeof(uint64_t) * step + VBYTE64_PADDING);
+  if (!key_buf || !data_buf) {
+    free(key_buf);
+    free(data_buf);
+    return 0;
+  }
+
+  size_t nbytes = 0;
+  off_t key_off = off + sizeof(size_t);
+  off_t data_off = key_off + sizeof(uint8_t) * ((n + 1) / 2);
+  // copy size to the first bytes
+  if (!vb64f_pwrite_all(fd, &n, sizeof(size_t), off))
+    goto clean;
 
-  vb64f_decode_delta(cf_keys, cf_data, out, *n, jmp_target);
+  for (size_t i = 0; i < n; i += step) {
+    size_t m = n - i < step ? n - i : step;
+    uint8_t *end = vb64_encode_mode(key_buf, data_buf, v + i, m,
+                                    i ? v[i - 1] : 0, mode);
+    size_t key_size = (m + 1) / 2, data_size = end - data_buf;
+    if (!vb64f_pwrite_all(fd, key_buf, key_size, key_off) ||
+        !vb64f_pwrite_all(fd, data_buf, data_size, data_off))
+      goto clean;
+    key_off += key_size;
+    data_off += data_size;
+  }
+  nbytes = data_off - off;
 
 clean:
-  fclose(cf_data);
-  fclose(cf_keys);
+  free(key_buf);
+  free(data_buf);
+  return nbytes;
+}
+
+size_t vb64fd_compress_delta(uint64_t *v, size_t n, int fd, off_t off) {
+  return vb64f_write_(fd, off, v, n, vb64_delta);
+}
+
+size_t vb64fd_compress_zdelta(uint64_t *v, size_t n, int fd, off_t off) {
+  return vb64f_write_(fd, off, v, n, vb64_zdelta);
+}
+
+size_t vb64fd_compress(uint64_t *v, size_t n, int fd, off_t off) {
+  return vb64f_write_(fd, off, v, n, vb64_plain);
+}
+
+static size_t vb64f_compress_(uint64_t *v, size_t n, const char *fpath,
+                              int mode) {
+  int fd = open(fpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return 0;
+
+  size_t nbytes = vb64f_write_(fd, 0, v, n, mode);
+  if (close(fd) != 0)
+    nbytes = 0;
+  return nbytes;
+}
+
+size_t vb64f_compress_delta(uint64_t *v, size_t n, const char *fpath) {
+  return vb64f_compress_(v, n, fpath, vb64_delta);
+}
+
+size_t vb64f_compress_zdelta(uint64_t *v, size_t n, const char *fpath) {
+  return vb64f_compress_(v, n, fpath, vb64_zdelta);
+}
+
+size_t vb64f_compress(uint64_t *v, size_t n, const char *fpath) {
+  return vb64f_compress_(v, n, fpath, vb64_plain);
+}
+
+// DECODE
+static int vb64f_pread_all(int fd, void *buf, size_t len, off_t off) {
+  uint8_t *p = (uint8_t *)buf;
+  while (len) {
+    ssize_t r = pread(fd, p, len, off);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return 0;
+    p += r;
+    len -= r;
+    off += r;
+  }
+  return 1;
+}
+
+/*
+ * Read the `_wl` layout stored in `fd` at `off` with two `pread`, one for the
+ * keys, whose lengths give the size of the data, and one for the data.
+ */
+static uint64_t *vb64f_read_(int fd, off_t off, size_t *n, size_t *clen,
+                             int mode) {
+  if (!vb64f_pread_all(fd, n, sizeof(size_t), off))
+    return NULL;
+  size_t key_size = sizeof(uint8_t) * (*n / 2 + (*n & 1));
+  uint8_t *keys = malloc(key_size);
+  if (!keys || !vb64f_pread_all(fd, keys, key_size, off + sizeof(size_t))) {
+    free(keys);
+    return NULL;
+  }
+  size_t data_size = 0;
+  for (size_t i = 0; i < key_size; ++i)
+    data_size += vb64_klen[keys[i]];
+
+  uint8_t *data = malloc(data_size + VBYTE64_PADDING);
+  uint64_t *out = vb64_malloc(sizeof(out[0]) * *n);
+  if (!data || !out ||
+      !vb64f_pread_all(fd, data, data_size,
+                       off + sizeof(size_t) + key_size)) {
+    free(keys);
+    free(data);
+    vb64_free(out);
+    return NULL;
+  }
+
+  vb64_decode_mode(keys, data, out, *n, mode);
+  if (clen)
+    *clen = sizeof(size_t) + key_size + data_size;
+  free(keys);
+  free(data);
+  return out;
+}
+
+uint64_t *vb64fd_decompress_delta(int fd, off_t off, size_t *n, size_t *clen) {
+  return vb64f_read_(fd, off, n, clen, vb64_delta);
+}
+
+uint64_t *vb64fd_decompress_zdelta(int fd, off_t off, size_t *n,
+                                   size_t *clen) {
+  return vb64f_read_(fd, off, n, clen, vb64_zdelta);
+}
+
+uint64_t *vb64fd_decompress(int fd, off_t off, size_t *n, size_t *clen) {
+  return vb64f_read_(fd, off, n, clen, vb64_plain);
+}
+
+static uint64_t *vb64f_decompress_(const char *fpath, size_t *n, int mode) {
+  int fd = open(fpath, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  uint64_t *out = vb64f_read_(fd, 0, n, NULL, mode);
+  close(fd);
+  return out;
+}
+
+uint64_t *vb64f_decompress_delta(const char *fpath, size_t *n) {
+  return vb64f_decompress_(fpath, n, vb64_delta);
+}
+
+uint64_t *vb64f_decompress_zdelta(const char *fpath, size_t *n) {
+  return vb64f_decompress_(fpath, n, vb64_zdelta);
+}
+
+uint64_t *vb64f_decompress(const char *fpath, size_t *n) {
+  return vb64f_decompress_(fpath, n, vb64_plain);
+}
+
+// Memory mapped files
+
+/*
+ * Map the `size` bytes of `fd` read-only, followed by at least
+ * `VBYTE64_PADDING` zero bytes. Returns NULL on failure.
+ */
+static uint8_t *vb64f_mmap_(int fd, size_t size, size_t *map_size) {
+  // reserve room for the padding, then map the file over the reservation:
+  // the bytes past the end of the file read as zeros instead of faulting
+  size_t page = sysconf(_SC_PAGESIZE);
+  *map_size = (size + VBYTE64_PADDING + page - 1) & ~(page - 1);
+  uint8_t *base = mmap(NULL, *map_size, PROT_READ,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    return NULL;
+  if (mmap(base, size, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0) ==
+      MAP_FAILED) {
+    int err = errno;
+    munmap(base, *map_size);
+    errno = err;
+    return NULL;
+  }
+  return base;
+}
+
+int vb64f_map(const char *fpath, struct vb64f_mapping *m) {
+  int fd = open(fpath, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  struct stat sb;
+  if (fstat(fd, &sb) != 0) {
+    close(fd);
+    return -1;
+  }
+  size_t size = sb.st_size, n;
+  if (size < sizeof(size_t) ||
+      pread(fd, &n, sizeof(size_t), 0) != (ssize_t)sizeof(size_t) ||
+      (size - sizeof(size_t)) < n / 2 + (n & 1)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  size_t map_size;
+  uint8_t *base = vb64f_mmap_(fd, size, &map_size);
+  int err = errno;
+  // the mapping keeps its own reference to the file
+  close(fd);
+  if (!base) {
+    errno = err;
+    return -1;
+  }
+
+  // the keys must not ask for more data than the file holds, the decoders
+  // would read past the padding
+  size_t key_size = sizeof(uint8_t) * (n / 2 + (n & 1));
+  if (size - sizeof(size_t) - key_size <
+      vb64_data_size(base + sizeof(size_t), n)) {
+    munmap(base, map_size);
+    errno = EINVAL;
+    return -1;
+  }
+
+  m->base = base;
+  m->size = size;
+  m->map_size = map_size;
+  m->n = n;
+  m->key_p = base + sizeof(size_t);
+  m->data_p = m->key_p + sizeof(uint8_t) * ((n + 1) / 2);
+  return 0;
+}
+
+void vb64f_unmap(struct vb64f_mapping *m) {
+  if (m->base)
+    munmap(m->base, m->map_size);
+  m->base = NULL;
+}
+
+void vb64f_map_decompress_delta(const struct vb64f_mapping *m, uint64_t *out) {
+  vb64_decode_delta(m->key_p, m->data_p, out, m->n);
+}
+
+void vb64f_map_decompress(const struct vb64f_mapping *m, uint64_t *out) {
+  vb64_decode(m->key_p, m->data_p, out, m->n);
+}
+
+// Streaming
+
+#define VBYTE64_SFRAME_HEAD (2 * sizeof(uint32_t))
+
+int vb64s_encoder_init(struct vb64s_encoder *e, int delta,
+                       size_t (*write)(const void *buf, size_t len, void *ud),
+                       void *ud) {
+  e->write = write;
+  e->ud = ud;
+  e->delta = delta;
+  e->err = 0;
+  e->prev = 0;
+  e->count = 0;
+  e->frame = malloc(VBYTE64_SFRAME_HEAD + VBYTE64_STREAM_FRAME / 2 +
+                    sizeof(uint64_t) * VBYTE64_STREAM_FRAME + VBYTE64_PADDING);
+  if (!e->frame)
+    return -1;
+  e->data_p = e->frame + VBYTE64_SFRAME_HEAD + VBYTE64_STREAM_FRAME / 2;
+  return 0;
+}
+
+static int vb64s_flush(struct vb64s_encoder *e) {
+  uint8_t *data_start =
+      e->frame + VBYTE64_SFRAME_HEAD + VBYTE64_STREAM_FRAME / 2;
+  uint32_t count = e->count, data_size = e->data_p - data_start;
+  size_t head_size = VBYTE64_SFRAME_HEAD + (e->count + 1) / 2;
+  memcpy(e->frame, &count, sizeof(uint32_t));
+  memcpy(e->frame + sizeof(uint32_t), &data_size, sizeof(uint32_t));
+  if (e->write(e->frame, head_size, e->ud) != head_size ||
+      (data_size && e->write(data_start, data_size, e->ud) != data_size))
+    e->err = -1;
+  e->count = 0;
+  e->data_p = data_start;
+  return e->err;
+}
+
+int vb64s_push(struct vb64s_encoder *e, const uint64_t *v, size_t n) {
+  while (n && !e->err) {
+    if (e->count == VBYTE64_STREAM_FRAME && vb64s_flush(e))
+      break;
+    size_t m = VBYTE64_STREAM_FRAME - e->count < n
+                   ? VBYTE64_STREAM_FRAME - e->count
+                   : n,
+           i = 0;
+    uint8_t *key_p = e->frame + VBYTE64_SFRAME_HEAD + e->count / 2;
+    if (e->count & 1) {
+      // complete the key byte left half filled by the previous batch
+      *key_p++ |=
+          vb64_benc_sel(e->delta ? v[0] - e->prev : v[0], &e->data_p) << 4;
+      e->prev = v[0];
+      i = 1;
+    }
+    size_t npairs = (m - i) / 2;
+    e->data_p = e->delta ? vb64_enc_pairs_delta(key_p, e->data_p, v + i,
+                                                npairs, e->prev)
+                         : vb64_enc_pairs(key_p, e->data_p, v + i, npairs, 0);
+    i += 2 * npairs;
+    if (i < m) {
+      uint64_t ov = e->delta ? (i ? v[i - 1] : e->prev) : 0;
+      key_p[npairs] = vb64_benc_sel(v[i] - ov, &e->data_p);
+    }
+    e->prev = v[m - 1];
+    e->count += m;
+    v += m;
+    n -= m;
+  }
+  return e->err;
+}
+
+int vb64s_finish(struct vb64s_encoder *e) {
+  if (!e->err && e->count)
+    vb64s_flush(e);
+  // the empty frame marks the end of the stream
+  if (!e->err)
+    vb64s_flush(e);
+  free(e->frame);
+  e->frame = NULL;
+  return e->err;
+}
+
+int vb64s_decoder_init(struct vb64s_decoder *d, int delta,
+                       size_t (*read)(void *buf, size_t len, void *ud),
+                       void *ud) {
+  d->read = read;
+  d->ud = ud;
+  d->delta = delta;
+  d->err = 0;
+  d->done = 0;
+  d->prev = 0;
+  d->count = d->pos = 0;
+  d->frame = malloc(VBYTE64_STREAM_FRAME / 2 +
+                    sizeof(uint64_t) * VBYTE64_STREAM_FRAME + VBYTE64_PADDING);
+  return d->frame ? 0 : -1;
+}
+
+static int vb64s_load(struct vb64s_decoder *d) {
+  uint8_t head[VBYTE64_SFRAME_HEAD];
+  uint32_t count, data_size;
+  if (d->read(head, VBYTE64_SFRAME_HEAD, d->ud) != VBYTE64_SFRAME_HEAD) {
+    d->err = -1;
+    return 0;
+  }
+  memcpy(&count, head, sizeof(uint32_t));
+  memcpy(&data_size, head + sizeof(uint32_t), sizeof(uint32_t));
+  if (count == 0) {
+    d->done = 1;
+    return 0;
+  }
+  if (count > VBYTE64_STREAM_FRAME || data_size > sizeof(uint64_t) * count) {
+    d->err = -1;
+    return 0;
+  }
+  size_t size = (count + 1) / 2 + data_size;
+  if (d->read(d->frame, size, d->ud) != size) {
+    d->err = -1;
+    return 0;
+  }
+  d->count = count;
+  d->pos = 0;
+  d->key_p = d->frame;
+  d->data_p = d->frame + (count + 1) / 2;
+  return 1;
+}
+
+size_t vb64s_next(struct vb64s_decoder *d, uint64_t *out, size_t max) {
+  size_t n = 0;
+  while (n < max && !d->err && !d->done) {
+    if (d->pos == d->count && !vb64s_load(d))
+      break;
+    size_t m = d->count - d->pos < max - n ? d->count - d->pos : max - n;
+    uint64_t *o = out + n;
+    if (d->pos & 1) {
+      // second half of a key byte left by the previous call
+      uint64_t val = vb64_bdec(&d->data_p, *d->key_p++ >> 4);
+      d->prev = *o++ = d->delta ? d->prev + val : val;
+      --m;
+      ++d->pos;
+      ++n;
+    }
+    if (d->delta)
+      d->data_p = vb64_decode_delta_base(d->key_p, d->data_p, o, m, d->prev);
+    else
+      d->data_p = vb64_decode(d->key_p, d->data_p, o, m);
+    if (m)
+      d->prev = o[m - 1];
+    d->key_p += m / 2;
+    d->pos += m;
+    n += m;
+  }
+  return n;
+}
+
+void vb64s_decoder_free(struct vb64s_decoder *d) {
+  free(d->frame);
+  d->frame = NULL;
+}
+
+// Container files
+
+#define VBYTE64_CMAGIC 0x43343642 // "B64C"
+#define VBYTE64_CVERSION 1
+
+struct vb64c_header {
+  uint32_t magic, version;
+  uint64_t count, dir_off;
+};
+
+// payloads and directory start on 8 byte boundaries
+#define VBYTE64_CALIGN(x) (((x) + 7) & ~(off_t)7)
+
+int vb64c_create(struct vb64c_writer *w, const char *fpath) {
+  w->fd = open(fpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (w->fd < 0)
+    return -1;
+  w->off = sizeof(struct vb64c_header);
+  w->count = w->cap = 0;
+  w->dir = NULL;
+  w->err = 0;
+  return 0;
+}
+
+int vb64c_add(struct vb64c_writer *w, uint64_t id, const uint64_t *v,
+              size_t n, int mode) {
+  if (w->err)
+    return -1;
+  if (w->count == w->cap) {
+    size_t cap = w->cap ? 2 * w->cap : 16;
+    struct vb64c_entry *dir = realloc(w->dir, sizeof(dir[0]) * cap);
+    if (!dir)
+      return w->err = -1;
+    w->dir = dir;
+    w->cap = cap;
+  }
+
+  if (mode < vb64c_plain || mode > vb64c_zdelta) {
+    errno = EINVAL;
+    return w->err = -1;
+  }
+  // the container modes are the ones of the file writer
+  size_t size = vb64f_write_(w->fd, w->off, v, n, mode);
+  if (!size)
+    return w->err = -1;
+
+  struct vb64c_entry *e = &w->dir[w->count++];
+  e->id = id;
+  e->n = n;
+  e->off = w->off;
+  e->size = size;
+  e->mode = mode;
+  e->min = n ? UINT64_MAX : 0;
+  e->max = 0;
+  for (size_t i = 0; i < n; i++) {
+    e->min = v[i] < e->min ? v[i] : e->min;
+    e->max = v[i] > e->max ? v[i] : e->max;
+  }
+  w->off = VBYTE64_CALIGN(w->off + (off_t)size);
+  return 0;
+}
+
+static int vb64c_entry_cmp(const void *a, const void *b) {
+  uint64_t x = ((const struct vb64c_entry *)a)->id;
+  uint64_t y = ((const struct vb64c_entry *)b)->id;
+  return (x > y) - (x < y);
+}
+
+int vb64c_finish(struct vb64c_writer *w) {
+  int err = w->err;
+  if (!err) {
+    qsort(w->dir, w->count, sizeof(w->dir[0]), vb64c_entry_cmp);
+    for (size_t i = 1; i < w->count; i++)
+      if (w->dir[i - 1].id == w->dir[i].id) {
+        errno = EINVAL;
+        err = -1;
+      }
+  }
+  // the header goes last: an interrupted file has no valid magic
+  struct vb64c_header h = {VBYTE64_CMAGIC, VBYTE64_CVERSION, w->count,
+                           (uint64_t)w->off};
+  if (!err && (!vb64f_pwrite_all(w->fd, w->dir, sizeof(w->dir[0]) * w->count,
+                                 w->off) ||
+               !vb64f_pwrite_all(w->fd, &h, sizeof(h), 0)))
+    err = -1;
+  if (close(w->fd) != 0)
+    err = -1;
+  free(w->dir);
+  w->dir = NULL;
+  w->fd = -1;
+  return err;
+}
+
+int vb64c_open(const char *fpath, struct vb64c_reader *r) {
+  int fd = open(fpath, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  struct stat sb;
+  if (fstat(fd, &sb) != 0) {
+    close(fd);
+    return -1;
+  }
+  size_t size = sb.st_size;
+  struct vb64c_header h;
+  if (size < sizeof(h) ||
+      pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+      h.magic != VBYTE64_CMAGIC || h.version != VBYTE64_CVERSION ||
+      h.dir_off < sizeof(h) || h.dir_off % 8 || h.dir_off > size ||
+      h.count > (size - h.dir_off) / sizeof(struct vb64c_entry)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  size_t map_size;
+  uint8_t *base = vb64f_mmap_(fd, size, &map_size);
+  int err = errno;
+  close(fd);
+  if (!base) {
+    errno = err;
+    return -1;
+  }
+
+  // every payload must lie between the header and the directory and hold
+  // its keys, checked without touching the payloads: the data the keys ask
+  // for is checked when the array is decoded
+  const struct vb64c_entry *dir =
+      (const struct vb64c_entry *)(base + h.dir_off);
+  for (size_t i = 0; i < h.count; i++) {
+    const struct vb64c_entry *e = &dir[i];
+    if (e->off < sizeof(h) || e->off > h.dir_off ||
+        e->size > h.dir_off - e->off || e->size < sizeof(size_t) ||
+        e->size - sizeof(size_t) < e->n / 2 + (e->n & 1) ||
+        e->mode > vb64c_zdelta || (i && dir[i - 1].id >= e->id)) {
+      munmap(base, map_size);
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  r->base = base;
+  r->size = size;
+  r->map_size = map_size;
+  r->count = h.count;
+  r->dir = dir;
+  return 0;
+}
+
+void vb64c_close(struct vb64c_reader *r) {
+  if (r->base)
+    munmap(r->base, r->map_size);
+  r->base = NULL;
+  r->dir = NULL;
+}
+
+const struct vb64c_entry *vb64c_find(const struct vb64c_reader *r,
+                                     uint64_t id) {
+  size_t lo = 0, hi = r->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (r->dir[mid].id < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < r->count && r->dir[lo].id == id ? &r->dir[lo] : NULL;
+}
+
+int vb64c_decompress_entry(const struct vb64c_reader *r,
+                           const struct vb64c_entry *e, uint64_t *out) {
+  // the keys must not ask for more data than the payload holds, only its
+  // own keys are read
+  const uint8_t *key_p = r->base + e->off + sizeof(size_t);
+  size_t key_size = sizeof(uint8_t) * ((e->n + 1) / 2);
+  if (e->size - sizeof(size_t) - key_size < vb64_data_size(key_p, e->n)) {
+    errno = EINVAL;
+    return -1;
+  }
+  vb64_decode_mode(key_p, key_p + key_size, out, e->n, e->mode);
+  return 0;
+}
+
+uint64_t *vb64c_decompress(const struct vb64c_reader *r, uint64_t id,
+                           size_t *n) {
+  const struct vb64c_entry *e = vb64c_find(r, id);
+  if (!e)
+    return NULL;
+  uint64_t *out = vb64_malloc(sizeof(out[0]) * e->n);
+  if (!out)
+    return NULL;
+  if (vb64c_decompress_entry(r, e, out) != 0) {
+    vb64_free(out);
+    return NULL;
+  }
+  *n = e->n;
+  return out;
+}
+
+// Batch loading
+
+// Files read at the same time, each one holds a buffer of its whole size.
+#define VBYTE64_LOAD_DEPTH 32
+// Threads of the `pread` pool used when io_uring is not available.
+#define VBYTE64_LOAD_THREADS 8
+// Largest single read, the length of a request is 32 bits.
+#define VBYTE64_LOAD_CHUNK (1 << 30)
+
+/*
+ * Decode the content of a whole file, the `_wl` layout, read into `buf`
+ * followed by `VBYTE64_PADDING` bytes. Returns NULL if it is truncated.
+ */
+static uint64_t *vb64f_decode_buf_(const uint8_t *buf, size_t size, size_t *n,
+                                   int mode) {
+  if (size < sizeof(size_t))
+    return NULL;
+  memcpy(n, buf, sizeof(size_t));
+  size_t key_size = sizeof(uint8_t) * (*n / 2 + (*n & 1));
+  if (size - sizeof(size_t) < key_size)
+    return NULL;
+  const uint8_t *key_p = buf + sizeof(size_t);
+  size_t data_size = 0;
+  for (size_t i = 0; i < key_size; ++i)
+    data_size += vb64_klen[key_p[i]];
+  if (size - sizeof(size_t) - key_size < data_size)
+    return NULL;
+
+  uint64_t *out = vb64_malloc(sizeof(out[0]) * *n);
+  if (!out)
+    return NULL;
+  vb64_decode_mode(key_p, key_p + key_size, out, *n, mode);
+  return out;
+}
+
+struct vb64f_load {
+  const char *const *fpaths;
+  size_t count;
+  int mode, err;
+  void (*done)(size_t i, uint64_t *v, size_t n, void *ud);
+  void *ud;
+};
+
+// decode a file read by either backend and hand it over, `buf` is released
+static void vb64f_load_done(struct vb64f_load *l, size_t i, uint8_t *buf,
+                            size_t size) {
+  size_t n = 0;
+  uint64_t *v = buf ? vb64f_decode_buf_(buf, size, &n, l->mode) : NULL;
+  free(buf);
+  if (!v) {
+    n = 0;
+    l->err = -1;
+  }
+  l->done(i, v, n, l->ud);
+}
+
+#ifdef VBYTE64_URING
+// Minimal io_uring submission and completion rings, using the raw syscalls.
+struct vb64_uring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+  unsigned queued; // sqes not yet submitted
+};
+
+static void vb64_uring_exit(struct vb64_uring *u) {
+  if (u->sqes)
+    munmap(u->sqes, u->sqes_size);
+  if (u->cq_ring && u->cq_ring != u->sq_ring)
+    munmap(u->cq_ring, u->cq_ring_size);
+  if (u->sq_ring)
+    munmap(u->sq_ring, u->sq_ring_size);
+  close(u->fd);
+}
+
+static int vb64_uring_init(struct vb64_uring *u, unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  memset(u, 0, sizeof(*u));
+  u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (u->fd < 0)
+    return 0;
+  // openat and statx need 5.6, fast poll tells a 5.7 kernel
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_FAST_POLL)) {
+    close(u->fd);
+    return 0;
+  }
+
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (u->cq_ring_size > u->sq_ring_size)
+    u->sq_ring_size = u->cq_ring_size;
+  u->cq_ring_size = u->sq_ring_size;
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (u->sq_ring == MAP_FAILED) {
+    u->sq_ring = NULL;
+    vb64_uring_exit(u);
+    return 0;
+  }
+  u->cq_ring = u->sq_ring;
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) {
+    u->sqes = NULL;
+    vb64_uring_exit(u);
+    return 0;
+  }
+
+  uint8_t *sq = (uint8_t *)u->sq_ring, *cq = (uint8_t *)u->cq_ring;
+  u->sq_head = (unsigned *)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)(sq + p.sq_off.array);
+  u->cq_head = (unsigned *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 1;
+}
+
+// the caller never has more requests in flight than there are entries
+static struct io_uring_sqe *vb64_uring_sqe(struct vb64_uring *u,
+                                           uint64_t user_data) {
+  unsigned tail = *u->sq_tail, idx = tail & *u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = user_data;
+  u->sq_array[idx] = idx;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  u->queued++;
+  return sqe;
+}
+
+// submit the queued requests, and wait for a completion if `wait`
+static int vb64_uring_enter(struct vb64_uring *u, int wait) {
+  while (u->queued || wait) {
+    int r = (int)syscall(__NR_io_uring_enter, u->fd, u->queued, wait ? 1 : 0,
+                         wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (r < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+      return 0;
+    }
+    u->queued -= r;
+    wait = 0;
+  }
+  return 1;
+}
+
+static struct io_uring_cqe *vb64_uring_peek(struct vb64_uring *u) {
+  unsigned head = *u->cq_head;
+  if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &u->cqes[head & *u->cq_mask];
+}
+
+static void vb64_uring_seen(struct vb64_uring *u) {
+  __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Each file goes through open, statx and as many reads as needed.
+enum vb64f_stage { vb64f_open, vb64f_statx, vb64f_read };
+
+struct vb64f_slot {
+  size_t i, size, pos;
+  int fd, stage;
+  uint8_t *buf;
+  struct statx stx;
+};
+
+static void vb64f_slot_read(struct vb64_uring *u, struct vb64f_slot *s,
+                            size_t k) {
+  size_t len = s->size - s->pos;
+  struct io_uring_sqe *sqe = vb64_uring_sqe(u, k);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = s->fd;
+  sqe->addr = (uint64_t)(uintptr_t)(s->buf + s->pos);
+  sqe->len = len < VBYTE64_LOAD_CHUNK ? len : VBYTE64_LOAD_CHUNK;
+  sqe->off = s->pos;
+  s->stage = vb64f_read;
+}
+
+/*
+ * Advance the slot `k` with the result `res` of its last request. Returns 1
+ * when the file is complete (or failed, `buf` is then NULL).
+ */
+static int vb64f_slot_step(struct vb64_uring *u, struct vb64f_slot *s,
+                           size_t k, int res) {
+  if (res < 0)
+    goto fail;
+  switch (s->stage) {
+  case vb64f_open: {
+    s->fd = res;
+    struct io_uring_sqe *sqe = vb64_uring_sqe(u, k);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = s->fd;
+    sqe->addr = (uint64_t)(uintptr_t) "";
+    sqe->len = STATX_SIZE;
+    sqe->off = (uint64_t)(uintptr_t)&s->stx;
+    sqe->statx_flags = AT_EMPTY_PATH;
+    s->stage = vb64f_statx;
+    return 0;
+  }
+  case vb64f_statx:
+    s->size = s->stx.stx_size;
+    s->buf = malloc(s->size + VBYTE64_PADDING);
+    if (!s->buf)
+      goto fail;
+    vb64f_slot_read(u, s, k);
+    return 0;
+  default:
+    if (res == 0) // shorter than its size
+      goto fail;
+    s->pos += res;
+    if (s->pos < s->size) {
+      vb64f_slot_read(u, s, k);
+      return 0;
+    }
+    close(s->fd);
+    return 1;
+  }
+
+fail:
+  if (s->fd >= 0)
+    close(s->fd);
+  free(s->buf);
+  s->buf = NULL;
+  return 1;
+}
+
+/*
+ * Cancel the requests of the `used` slots and wait for all of them to
+ * complete, so that the kernel is done writing to the slots and their
+ * buffers. Each slot has exactly one request, queued or in flight.
+ * Returns 0 if the ring cannot be entered, the requests may then still be
+ * running.
+ */
+static int vb64f_uring_drain(struct vb64_uring *u, struct vb64f_slot *slots,
+                             int *used) {
+  size_t pending = 0;
+  for (size_t k = 0; k < VBYTE64_LOAD_DEPTH; k++)
+    if (used[k]) {
+      // the cancel completions are told apart by their tag
+      struct io_uring_sqe *sqe = vb64_uring_sqe(u, VBYTE64_LOAD_DEPTH + k);
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = k;
+      pending++;
+    }
+  if (!vb64_uring_enter(u, 0))
+    return 0;
+  while (pending) {
+    if (!vb64_uring_enter(u, !vb64_uring_peek(u)))
+      return 0;
+    struct io_uring_cqe *cqe;
+    while ((cqe = vb64_uring_peek(u))) {
+      size_t k = cqe->user_data;
+      int res = cqe->res;
+      vb64_uring_seen(u);
+      if (k >= VBYTE64_LOAD_DEPTH || !used[k])
+        continue;
+      // an open that went through before the cancel leaves a descriptor
+      if (slots[k].stage == vb64f_open && res >= 0)
+        slots[k].fd = res;
+      used[k] = 0;
+      pending--;
+    }
+  }
+  return 1;
+}
+
+static int vb64f_load_uring(struct vb64f_load *l) {
+  // on the heap: if the ring breaks with requests in flight and cannot be
+  // drained, the slots are left to the kernel instead of going out of scope
+  struct vb64f_slot *slots = malloc(sizeof(slots[0]) * VBYTE64_LOAD_DEPTH);
+  struct vb64_uring u;
+  // twice the slots, room for a cancel per slot when draining
+  if (!slots || !vb64_uring_init(&u, 2 * VBYTE64_LOAD_DEPTH)) {
+    free(slots);
+    return 0;
+  }
+
+  size_t free_slots[VBYTE64_LOAD_DEPTH], nfree = VBYTE64_LOAD_DEPTH;
+  for (size_t k = 0; k < VBYTE64_LOAD_DEPTH; k++)
+    free_slots[k] = VBYTE64_LOAD_DEPTH - 1 - k;
+
+  size_t next = 0, inflight = 0;
+  while (next < l->count || inflight) {
+    // fill the free slots, then let the kernel work while decoding
+    for (; next < l->count && nfree; next++, inflight++) {
+      size_t k = free_slots[--nfree];
+      slots[k] = (struct vb64f_slot){next, 0, 0, -1, vb64f_open, NULL, {0}};
+      struct io_uring_sqe *sqe = vb64_uring_sqe(&u, k);
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uint64_t)(uintptr_t)l->fpaths[next];
+      sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    }
+    if (!vb64_uring_enter(&u, !vb64_uring_peek(&u)))
+      break;
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = vb64_uring_peek(&u))) {
+      size_t k = cqe->user_data;
+      int res = cqe->res;
+      vb64_uring_seen(&u);
+      if (!vb64f_slot_step(&u, &slots[k], k, res))
+        continue;
+      // keep the next requests going during the decoding
+      vb64_uring_enter(&u, 0);
+      vb64f_load_done(l, slots[k].i, slots[k].buf, slots[k].size);
+      free_slots[nfree++] = k;
+      inflight--;
+    }
+  }
+
+  // io_uring_enter failed for good: what is left fails too, once the kernel
+  // is done with the slots, or the slots and their buffers are leaked
+  int used[VBYTE64_LOAD_DEPTH], pending[VBYTE64_LOAD_DEPTH];
+  for (size_t k = 0; k < VBYTE64_LOAD_DEPTH; k++)
+    used[k] = 1;
+  for (size_t k = 0; k < nfree; k++)
+    used[free_slots[k]] = 0;
+  memcpy(pending, used, sizeof(used));
+  int drained = !inflight || vb64f_uring_drain(&u, slots, pending);
+  vb64_uring_exit(&u);
+  for (size_t k = 0; k < VBYTE64_LOAD_DEPTH; k++)
+    if (used[k]) {
+      if (drained) {
+        vb64f_slot_step(&u, &slots[k], k, -1);
+      } else if (slots[k].fd >= 0) {
+        // the kernel holds its own reference to the file of a pending read
+        close(slots[k].fd);
+      }
+      vb64f_load_done(l, slots[k].i, NULL, 0);
+    }
+  for (; next < l->count; next++)
+    vb64f_load_done(l, next, NULL, 0);
+  if (drained)
+    free(slots);
+  return 1;
+}
+#endif
+
+/*
+ * Thread pool fallback: the workers open and read whole files, at most
+ * `VBYTE64_LOAD_DEPTH` ahead of the caller, that decodes them as they come.
+ */
+struct vb64f_pool {
+  struct vb64f_load *l;
+  pthread_mutex_t lock;
+  pthread_cond_t ready, room;
+  size_t next, produced, consumed;
+  struct vb64f_pool_item {
+    size_t i, size;
+    uint8_t *buf;
+  } items[VBYTE64_LOAD_DEPTH];
+};
+
+static uint8_t *vb64f_read_file(const char *fpath, size_t *size) {
+  int fd = open(fpath, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  struct stat sb;
+  uint8_t *buf = NULL;
+  if (fstat(fd, &sb) == 0) {
+    *size = sb.st_size;
+    buf = malloc(*size + VBYTE64_PADDING);
+    if (buf && !vb64f_pread_all(fd, buf, *size, 0)) {
+      free(buf);
+      buf = NULL;
+    }
+  }
+  close(fd);
+  return buf;
+}
+
+static void *vb64f_pool_thread(void *arg) {
+  struct vb64f_pool *p = (struct vb64f_pool *)arg;
+  pthread_mutex_lock(&p->lock);
+  while (p->next < p->l->count) {
+    size_t i = p->next++;
+    pthread_mutex_unlock(&p->lock);
+    size_t size = 0;
+    uint8_t *buf = vb64f_read_file(p->l->fpaths[i], &size);
+    pthread_mutex_lock(&p->lock);
+    while (p->produced - p->consumed == VBYTE64_LOAD_DEPTH)
+      pthread_cond_wait(&p->room, &p->lock);
+    p->items[p->produced++ % VBYTE64_LOAD_DEPTH] =
+        (struct vb64f_pool_item){i, size, buf};
+    pthread_cond_signal(&p->ready);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+static void vb64f_load_pool(struct vb64f_load *l) {
+  struct vb64f_pool p = {.l = l};
+  pthread_t th[VBYTE64_LOAD_THREADS];
+  int nthreads = 0;
+  pthread_mutex_init(&p.lock, NULL);
+  pthread_cond_init(&p.ready, NULL);
+  pthread_cond_init(&p.room, NULL);
+  for (; nthreads < VBYTE64_LOAD_THREADS && (size_t)nthreads < l->count;
+       nthreads++)
+    if (pthread_create(&th[nthreads], NULL, vb64f_pool_thread, &p) != 0)
+      break;
+
+  if (!nthreads) {
+    // no thread available, read and decode one file at the time
+    for (size_t i = 0; i < l->count; i++) {
+      size_t size = 0;
+      uint8_t *buf = vb64f_read_file(l->fpaths[i], &size);
+      vb64f_load_done(l, i, buf, size);
+    }
+  }
+  for (size_t k = 0; nthreads && k < l->count; k++) {
+    pthread_mutex_lock(&p.lock);
+    while (p.produced == p.consumed)
+      pthread_cond_wait(&p.ready, &p.lock);
+    struct vb64f_pool_item it = p.items[p.consumed++ % VBYTE64_LOAD_DEPTH];
+    pthread_cond_signal(&p.room);
+    pthread_mutex_unlock(&p.lock);
+    vb64f_load_done(l, it.i, it.buf, it.size);
+  }
+
+  for (int t = 0; t < nthreads; t++)
+    pthread_join(th[t], NULL);
+  pthread_mutex_destroy(&p.lock);
+  pthread_cond_destroy(&p.ready);
+  pthread_cond_destroy(&p.room);
+}
+
+static int vb64f_load_(const char *const *fpaths, size_t count, int mode,
+                       void (*done)(size_t i, uint64_t *v, size_t n, void *ud),
+                       void *ud) {
+  struct vb64f_load l = {fpaths, count, mode, 0, done, ud};
+#ifdef VBYTE64_URING
+  if (!getenv("VBYTE64_NO_URING") && vb64f_load_uring(&l))
+    return l.err;
+#endif
+  vb64f_load_pool(&l);
+  return l.err;
+}
+
+int vb64f_load_delta(const char *const *fpaths, size_t count,
+                     void (*done)(size_t i, uint64_t *v, size_t n, void *ud),
+                     void *ud) {
+  return vb64f_load_(fpaths, count, vb64_delta, done, ud);
+}
+
+int vb64f_load(const char *const *fpaths, size_t count,
+               void (*done)(size_t i, uint64_t *v, size_t n, void *ud),
+               void *ud) {
+  return vb64f_load_(fpaths, count, vb64_plain, done, ud);
+}
+
+// Grouped keys
+
+#define VBYTE64_GHEAD_SIZE (sizeof(size_t) + 4)
+
+static const uint8_t vb64g_default_lens[4] = {1, 2, 4, 8};
+
+// Code table of the grouped format, with the smallest code fitting a value
+// of each byte length, and for each key byte the two key bytes of the nibble
+// format and the number of data bytes.
+struct vb64g_codes {
+  uint8_t lens[4];
+  uint8_t code[9];
+  uint8_t glen[256];
+  uint16_t pairs[256];
+};
+
+// `lens` must be increasing and end with 8, so that every value fits
+static int vb64g_codes_init(struct vb64g_codes *c, const uint8_t *lens) {
+  if (!lens)
+    lens = vb64g_default_lens;
+  if (lens[3] != 8 || lens[0] >= lens[1] || lens[1] >= lens[2] ||
+      lens[2] >= lens[3])
+    return 0;
+  memcpy(c->lens, lens, 4);
+  for (int b = 0, k = 0; b <= 8; b++) {
+    while (lens[k] < b)
+      k++;
+    c->code[b] = k;
+  }
+  for (int k = 0; k < 256; k++) {
+    uint8_t l[4] = {lens[k & 3], lens[k >> 2 & 3], lens[k >> 4 & 3],
+                    lens[k >> 6]};
+    c->glen[k] = l[0] + l[1] + l[2] + l[3];
+    uint8_t p[2] = {(uint8_t)(l[0] | l[1] << 4), (uint8_t)(l[2] | l[3] << 4)};
+    memcpy(&c->pairs[k], p, 2);
+  }
+  return 1;
+}
+
+static inline uint8_t vb64g_code(const struct vb64g_codes *c, uint64_t x) {
+  return c->code[x ? 8U - (__builtin_clzll(x | 1) >> 3) : 0];
+}
+
+static size_t vb64g_encode_size(const struct vb64g_codes *c, const uint64_t *v,
+                                size_t n, int delta) {
+  size_t nbytes = 0;
+  for (size_t i = 0; i < n; i++)
+    nbytes += c->lens[vb64g_code(c, delta ? v[i] - (i ? v[i - 1] : 0) : v[i])];
+  return nbytes;
+}
+
+// writes up to 8 bytes past the returned data end
+static uint8_t *vb64g_encode(const struct vb64g_codes *c, uint8_t *key_p,
+                             uint8_t *data_p, const uint64_t *v, size_t n,
+                             int delta) {
+  uint64_t prev = 0;
+  for (size_t i = 0; i < n; i += 4) {
+    uint8_t key = 0;
+    for (size_t j = 0; j < 4 && i + j < n; j++) {
+      uint64_t x = delta ? v[i + j] - prev : v[i + j];
+      uint8_t code = vb64g_code(c, x);
+      memcpy(data_p, &x, sizeof(x));
+      data_p += c->lens[code];
+      key |= code << 2 * j;
+      prev = v[i + j];
+    }
+    key_p[i / 4] = key;
+  }
+  return data_p;
+}
+
+/*
+ * Each key byte (four values) is translated to two key bytes of the nibble
+ * format, one cache resident block at the time, so that the pair kernels
+ * decode the data. Only the blocks followed by less than 16 data bytes go
+ * through the safe decoders.
+ */
+static const uint8_t *vb64g_decode(const struct vb64g_codes *c,
+                                   const uint8_t *key_p, const uint8_t *data_p,
+                                   uint64_t *o, size_t n, int delta) {
+  uint16_t pairs[VBYTE64_BLOCK_PAIRS / 2];
+  size_t ngroups = n / 4, tail = 0;
+  // the unused codes of a partial last key byte have no data
+  for (size_t j = 4 * ngroups; j < n; j++)
+    tail += c->lens[key_p[ngroups] >> 2 * (j & 3) & 3];
+  while (ngroups && tail < 16)
+    tail += c->glen[key_p[--ngroups]];
+
+  uint64_t prev = 0;
+  size_t i = 0, block = 2 * VBYTE64_BLOCK_PAIRS;
+  for (; i + block <= 4 * ngroups; i += block) {
+    for (size_t k = 0; k < block / 4; k++)
+      pairs[k] = c->pairs[key_p[i / 4 + k]];
+    data_p = vb64_dec_pairs((const uint8_t *)pairs, data_p, o + i, block / 2);
+    if (delta)
+      prev = vb64_scan(o + i, block, prev);
+  }
+  for (; i < n; i += block) {
+    size_t m = n - i < block ? n - i : block;
+    for (size_t k = 0; k < (m + 3) / 4; k++)
+      pairs[k] = c->pairs[key_p[i / 4 + k]];
+    if (delta) {
+      data_p = vb64_decode_delta_base((const uint8_t *)pairs, data_p, o + i,
+                                      m, prev);
+      prev = o[i + m - 1];
+    } else {
+      data_p = vb64_decode((const uint8_t *)pairs, data_p, o + i, m);
+    }
+  }
+  return data_p;
+}
+
+static size_t vb64g_compressed_size_(const uint64_t *v, size_t n,
+                                     const uint8_t *lens, int delta) {
+  struct vb64g_codes c;
+  if (!vb64g_codes_init(&c, lens))
+    return 0;
+  size_t key_size = sizeof(uint8_t) * ((n + 3) / 4);
+  return VBYTE64_GHEAD_SIZE + key_size + vb64g_encode_size(&c, v, n, delta) +
+         VBYTE64_PADDING;
+}
+
+size_t vb64gd_compressed_size(const uint64_t *v, size_t n,
+                              const uint8_t *lens) {
+  return vb64g_compressed_size_(v, n, lens, 1);
+}
+
+size_t vb64g_compressed_size(const uint64_t *v, size_t n,
+                             const uint8_t *lens) {
+  return vb64g_compressed_size_(v, n, lens, 0);
+}
+
+static uint8_t *vb64g_compress_(uint64_t *v, size_t n, const uint8_t *lens,
+                                size_t *clen, int delta) {
+  struct vb64g_codes c;
+  if (!vb64g_codes_init(&c, lens))
+    return NULL;
+  size_t key_size = sizeof(uint8_t) * ((n + 3) / 4);
+  size_t data_size = vb64g_encode_size(&c, v, n, delta);
+  size_t size = VBYTE64_GHEAD_SIZE + key_size + data_size;
+  uint8_t *out = vb64_malloc(size + VBYTE64_PADDING);
+  if (!out)
+    return NULL;
+
+  memcpy(out, &n, sizeof(size_t));
+  memcpy(out + sizeof(size_t), c.lens, 4);
+  uint8_t *key_p = out + VBYTE64_GHEAD_SIZE;
+  vb64g_encode(&c, key_p, key_p + key_size, v, n, delta);
+  if (clen)
+    *clen = size;
+  return out;
+}
+
+uint8_t *vb64g_compress_delta(uint64_t *v, size_t n, const uint8_t *lens,
+                              size_t *clen) {
+  return vb64g_compress_(v, n, lens, clen, 1);
+}
+
+uint8_t *vb64g_compress(uint64_t *v, size_t n, const uint8_t *lens,
+                        size_t *clen) {
+  return vb64g_compress_(v, n, lens, clen, 0);
+}
+
+static uint64_t *vb64g_decompress_(const uint8_t *in, size_t *n, int delta) {
+  struct vb64g_codes c;
+  memcpy(n, in, sizeof(size_t));
+  if (!vb64g_codes_init(&c, in + sizeof(size_t)))
+    return NULL;
+  uint64_t *out = vb64_malloc(sizeof(out[0]) * *n);
+  if (!out)
+    return NULL;
+  const uint8_t *key_p = in + VBYTE64_GHEAD_SIZE;
+  vb64g_decode(&c, key_p, key_p + (*n + 3) / 4, out, *n, delta);
+  return out;
+}
+
+uint64_t *vb64g_decompress_delta(const uint8_t *in, size_t *n) {
+  return vb64g_decompress_(in, n, 1);
+}
+
+uint64_t *vb64g_decompress(const uint8_t *in, size_t *n) {
+  return vb64g_decompress_(in, n, 0);
+}
+
+// Extended keys
+
+// Codes above 8 stand for a run of values of the delta stream, whose length
+// follows in the data, in 1, 2 or 4 bytes: runs of zero deltas (repeated
+// values) or runs repeating the previous delta (constant stride).
+enum vb64x_code {
+  vb64x_zeros = 9,
+  vb64x_repeat = 12,
+  vb64x_reserved = 15,
+};
+
+#define VBYTE64_XHEAD_SIZE (3 * sizeof(size_t))
+// Shorter runs are left to the plain codes: they save few bytes, but cut the
+// keys into short stretches that have to be decoded one code at the time.
+#define VBYTE64_XRUN_MIN 8
+// Below this many key bytes the SIMD decoder is not worth its safe tail.
+#define VBYTE64_XSTRETCH_MIN 8
+
+static inline void vb64x_put_key(uint8_t *key_p, size_t nib, uint8_t code) {
+  if (nib & 1)
+    key_p[nib / 2] |= code << 4;
+  else
+    key_p[nib / 2] = code;
+}
+
+// bit 3 of every code above 8 in the 16 codes of `x`
+static inline uint64_t vb64x_runs(uint64_t x) {
+  const uint64_t ones = 0x1111111111111111ULL;
+  return (x & ones << 3) & ((x | x >> 1 | x >> 2) & ones) << 3;
+}
+
+// number of key bytes from `b` up to `e` before the first one with a run
+static size_t vb64x_stretch(const uint8_t *key_p, size_t b, size_t e) {
+  size_t i = b;
+  for (; i + 8 <= e; i += 8) {
+    uint64_t x;
+    memcpy(&x, key_p + i, sizeof(x));
+    uint64_t r = vb64x_runs(x);
+    if (r)
+      return i + __builtin_ctzll(r) / 8 - b;
+  }
+  for (; i < e && !vb64x_runs(key_p[i]); i++)
+    ;
+  return i - b;
+}
+
+// plain delta codes for the values `[i, j)`
+static uint8_t *vb64x_encode_stretch(uint8_t *key_p, size_t *nib,
+                                     uint8_t *data_p, const uint64_t *v,
+                                     size_t i, size_t j) {
+  if (i < j && (*nib & 1)) {
+    vb64x_put_key(key_p, (*nib)++,
+                  vb64_benc_sel(v[i] - (i ? v[i - 1] : 0), &data_p));
+    i++;
+  }
+  size_t npairs = (j - i) / 2;
+  data_p = vb64_enc_pairs_delta(key_p + *nib / 2, data_p, v + i, npairs,
+                                i ? v[i - 1] : 0);
+  *nib += 2 * npairs;
+  i += 2 * npairs;
+  if (i < j)
+    vb64x_put_key(key_p, (*nib)++,
+                  vb64_benc_sel(v[i] - (i ? v[i - 1] : 0), &data_p));
+  return data_p;
+}
+
+// `r` values of a run starting with code `base`, split in runs of 2^32 - 1
+static uint8_t *vb64x_encode_run(uint8_t *key_p, size_t *nib, uint8_t *data_p,
+                                 uint8_t base, size_t r) {
+  while (r) {
+    uint32_t count = r < UINT32_MAX ? r : UINT32_MAX;
+    int w = count < (1 << 8) ? 0 : count < (1 << 16) ? 1 : 2;
+    vb64x_put_key(key_p, (*nib)++, base + w);
+    memcpy(data_p, &count, 1 << w);
+    data_p += 1 << w;
+    r -= count;
+  }
+  return data_p;
+}
+
+/*
+ * Encode the deltas of `v` into the keys at `key_p` and the data at `data_p`,
+ * setting `nkeys` to the number of codes. The stretches between runs go
+ * through the pair kernels.
+ */
+static uint8_t *vb64x_encode(uint8_t *key_p, uint8_t *data_p,
+                             const uint64_t *v, size_t n, size_t *nkeys) {
+  size_t nib = 0, i = 0, j = 0;
+  uint64_t pd = 0; // delta of the value before `j`
+  while (j < n) {
+    uint64_t d = v[j] - (j ? v[j - 1] : 0);
+    if (d != 0 && (d != pd || j == 0)) {
+      pd = d;
+      j++;
+      continue;
+    }
+    // a run of `d` (zero, or the previous delta) starts at `j`
+    size_t k = j + 1;
+    while (k < n && v[k] - v[k - 1] == d)
+      k++;
+    pd = d;
+    if (k - j < VBYTE64_XRUN_MIN) {
+      j = k;
+      continue;
+    }
+    data_p = vb64x_encode_stretch(key_p, &nib, data_p, v, i, j);
+    data_p = vb64x_encode_run(key_p, &nib, data_p,
+                              d ? vb64x_repeat : vb64x_zeros, k - j);
+    i = j = k;
+  }
+  data_p = vb64x_encode_stretch(key_p, &nib, data_p, v, i, n);
+  *nkeys = nib;
+  return data_p;
+}
+
+uint8_t *vb64x_compress_delta(uint64_t *v, size_t n, size_t *clen) {
+  // runs never take more bytes than the plain codes they replace, so the
+  // bound of the plain format holds, the data is moved after the keys later
+  size_t key_cap = sizeof(uint8_t) * ((n + 1) / 2);
+  uint8_t *cdata =
+      (uint8_t *)vb64_malloc(VBYTE64_XHEAD_SIZE + vb64_max_compressed_size(n));
+  if (!cdata)
+    return NULL;
+
+  size_t nkeys;
+  uint8_t *key_p = cdata + VBYTE64_XHEAD_SIZE, *data_start = key_p + key_cap;
+  uint8_t *data_end = vb64x_encode(key_p, data_start, v, n, &nkeys);
+  size_t key_size = sizeof(uint8_t) * ((nkeys + 1) / 2);
+  memmove(key_p + key_size, data_start, data_end - data_start);
+  memcpy(cdata, &n, sizeof(size_t));
+  memcpy(cdata + sizeof(size_t), &nkeys, sizeof(size_t));
+
+  size_t data_size = data_end - data_start;
+  memcpy(cdata + 2 * sizeof(size_t), &data_size, sizeof(size_t));
+  size_t used = VBYTE64_XHEAD_SIZE + key_size + data_size;
+  if (clen)
+    *clen = used;
+  return (uint8_t *)vb64_shrink(cdata, used + VBYTE64_PADDING);
+}
+
+/*
+ * Expand a run of `count` values following `x` with the delta `d` (0 for a
+ * run of zeros). While there is `room` in the output the values are stored
+ * four at the time, past `count` if need be, so that short runs of any
+ * length take the same path.
+ */
+static inline void vb64x_run(uint64_t *o, size_t count, size_t room,
+                             uint64_t x, uint64_t d) {
+  size_t i = 0;
+  for (; i < count && i + 4 <= room; i += 4) {
+    o[i] = x + (i + 1) * d;
+    o[i + 1] = x + (i + 2) * d;
+    o[i + 2] = x + (i + 3) * d;
+    o[i + 3] = x + (i + 4) * d;
+  }
+  for (; i < count; ++i)
+    o[i] = x + (i + 1) * d;
+}
+
+// the low `code` bytes of `val`
+static inline uint64_t vb64x_trim(uint64_t val, unsigned code) {
+  return code < 8 ? val & ((1ULL << 8 * code) - 1) : val;
+}
+
+// `code` bytes at `data_p`, read as one 8 bytes load when not past `end`
+static inline uint64_t vb64x_load(const uint8_t **data_pp, const uint8_t *end,
+                                  unsigned code) {
+  if (*data_pp + sizeof(uint64_t) > end)
+    return vb64_bdec(data_pp, code);
+  uint64_t val;
+  memcpy(&val, *data_pp, sizeof(val));
+  *data_pp += code;
+  return vb64x_trim(val, code);
+}
+
+static void vb64x_decode(const uint8_t *key_p, const uint8_t *data_p,
+                         const uint8_t *data_end, size_t nkeys, uint64_t *out,
+                         size_t n) {
+  size_t i = 0, nib = 0, next = 0;
+  uint64_t prev = 0, pd = 0;
+  while (i < n && nib < nkeys) {
+    // a stretch of key bytes without runs goes to the pair kernels, a short
+    // one ends at a run so there is no need to look again before it
+    uint8_t k = key_p[nib / 2];
+    if (!(nib & 1) && nib / 2 >= next && !vb64x_runs(k)) {
+      size_t b = nib / 2, end = b + (n - i) / 2;
+      end = end < nkeys / 2 ? end : nkeys / 2;
+      size_t len = vb64x_stretch(key_p, b, end);
+      next = b + len + 1;
+      if (len >= VBYTE64_XSTRETCH_MIN) {
+        size_t m = 2 * len;
+        data_p = vb64_decode_delta_base(key_p + b, data_p, out + i, m, prev);
+        pd = out[i + m - 1] - out[i + m - 2];
+        prev = out[i + m - 1];
+        i += m;
+        nib += m;
+        continue;
+      }
+    }
+
+    // a key byte without runs is read with two loads and a single step
+    // of `data_p`
+    if (!(nib & 1) && !vb64x_runs(k) && nib + 2 <= nkeys && i + 2 <= n &&
+        data_p + 2 * sizeof(uint64_t) <= data_end) {
+      uint64_t v0, v1;
+      memcpy(&v0, data_p, sizeof(v0));
+      memcpy(&v1, data_p + (k & 0xF), sizeof(v1));
+      data_p += vb64_klen[k];
+      out[i] = prev += vb64x_trim(v0, k & 0xF);
+      out[i + 1] = prev += pd = vb64x_trim(v1, k >> 4);
+      i += 2;
+      nib += 2;
+      continue;
+    }
+
+    uint8_t code = k >> 4 * (nib & 1) & 0xF;
+    nib++;
+    if (code <= 8) {
+      pd = vb64x_load(&data_p, data_end, code);
+      out[i++] = prev += pd;
+      continue;
+    }
+    if (code == vb64x_reserved)
+      break;
+    size_t count = vb64x_load(&data_p, data_end, 1 << (code - vb64x_zeros) % 3);
+    size_t r = count < n - i ? count : n - i;
+    if (code < vb64x_repeat)
+      pd = 0;
+    vb64x_run(out + i, r, n - i, prev, pd);
+    prev += r * pd;
+    i += r;
+  }
+  // only for corrupted input
+  vb64x_run(out + i, n - i, n - i, prev, 0);
+}
+
+uint64_t *vb64x_decompress_delta(const uint8_t *in, size_t *n) {
+  size_t nkeys, data_size;
+  memcpy(n, in, sizeof(size_t));
+  memcpy(&nkeys, in + sizeof(size_t), sizeof(size_t));
+  memcpy(&data_size, in + 2 * sizeof(size_t), sizeof(size_t));
+  uint64_t *out = vb64_malloc(sizeof(out[0]) * *n);
+  if (!out)
+    return NULL;
+  const uint8_t *key_p = in + VBYTE64_XHEAD_SIZE;
+  const uint8_t *data_p = key_p + (nkeys + 1) / 2;
+  vb64x_decode(key_p, data_p, data_p + data_size, nkeys, out, *n);
   return out;
 }
@@ -3,6 +3,30 @@
 
 // #define VBYTE64_NO_CLZ
 #define VBYTE64_PADDING 64
+// Values per block of the blocked format, must be even
+#define VBYTE64_BLOCK_SIZE 128
+// Maximum values per frame of the streaming format, must be even
+#define VBYTE64_STREAM_FRAME (1 << 16)
+
+/*
+ * Header-only build: define `VBYTE64_HEADER_ONLY` before including this
+ * header and the library is compiled in the including translation unit, every
+ * function being `static inline`, so that calls in hot loops can be inlined
+ * and specialized on their constant arguments (mode, width, small `n`).
+ * vbyte64.c and vbyte64_width.h must be in the include path, and the
+ * translation unit must be C. The library state (allocator of each thread,
+ * kernels picked for the CPU) is then private to the translation unit.
+ * The library needs `_GNU_SOURCE`: include this header first, or define it
+ * before any system header.
+ */
+#ifdef VBYTE64_HEADER_ONLY
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#define VBYTE64_API static inline
+#else
+#define VBYTE64_API
+#endif // VBYTE64_HEADER_ONLY
 
 #ifdef __cplusplus
 #include <cstdint>
@@ -14,6 +38,80 @@ extern "C" {
 #include <stdlib.h>
 #include <stdio.h>
 #endif // __cplusplus
+#include <sys/types.h>
+
+/*
+ * Allocator used for every array returned by the library.
+ * `alloc` is mandatory, `realloc` is only used to shrink allocations and
+ * `free` can be `NULL` for allocators that release memory in bulk (e.g. the
+ * arena below). `ud` is passed untouched to the three functions.
+ */
+struct vb64_allocator {
+  void *(*alloc)(size_t size, void *ud);
+  void *(*realloc)(void *ptr, size_t size, void *ud);
+  void (*free)(void *ptr, void *ud);
+  void *ud;
+};
+
+/*
+ * Set the allocator used by the calling thread, `NULL` restores the default
+ * `malloc`/`realloc`/`free` one. The allocator is copied.
+ * Arrays returned by the library must be released with `vb64_free` while the
+ * same allocator is set (or with `free` when using the default one).
+ */
+VBYTE64_API void vb64_set_allocator(const struct vb64_allocator *a);
+
+/*
+ * Release an array returned by the library through the current allocator.
+ */
+VBYTE64_API void vb64_free(void *ptr);
+
+/*
+ * Bump allocator, memory is carved out of blocks of `block_size` bytes (or
+ * larger, for bigger requests) and released all at once.
+ * `vb64_arena_reset` keeps the last block around for reuse, while
+ * `vb64_arena_destroy` returns everything to the system.
+ * `vb64_arena_allocator` wraps an arena for `vb64_set_allocator`, the arena
+ * must outlive its use.
+ */
+struct vb64_arena_block;
+struct vb64_arena {
+  struct vb64_arena_block *head;
+  void *last;
+  size_t block_size;
+};
+
+VBYTE64_API void vb64_arena_init(struct vb64_arena *a, size_t block_size);
+VBYTE64_API void *vb64_arena_alloc(struct vb64_arena *a, size_t size);
+VBYTE64_API void vb64_arena_reset(struct vb64_arena *a);
+VBYTE64_API void vb64_arena_destroy(struct vb64_arena *a);
+VBYTE64_API struct vb64_allocator vb64_arena_allocator(struct vb64_arena *a);
+
+/*
+ * Instruction set levels of the kernels. The best level supported by the CPU
+ * (`vb64_max_isa`) is picked at load time, unless the `VBYTE64_ISA`
+ * environment variable names another supported one ("scalar", "ssse3",
+ * "avx2", "avx512" or "bmi2"). Every level produces the same bytes.
+ * The "bmi2" level is never picked on its own: it decodes without shuffles
+ * (two loads and `bzhi` per key byte), for CPUs whose SIMD shuffles are slow.
+ * `vb64_set_isa` switches the level of the whole process, it must not race
+ * with other calls into the library. It returns 0, or -1 with `errno` set to
+ * `ENOTSUP` if the CPU does not support the level.
+ * `vb64_isa_name` returns the name of a supported level, NULL otherwise.
+ */
+enum vb64_isa {
+  vb64_isa_scalar = 0,
+  vb64_isa_ssse3,
+  vb64_isa_avx2,
+  vb64_isa_avx512,
+  vb64_isa_bmi2,
+  vb64_isa_count,
+};
+
+VBYTE64_API int vb64_max_isa(void);
+VBYTE64_API int vb64_get_isa(void);
+VBYTE64_API int vb64_set_isa(int isa);
+VBYTE64_API const char *vb64_isa_name(int isa);
 
 /*
  * Calculate the exact size required to compress array `v` of size `n`
@@ -22,7 +120,7 @@ extern "C" {
  * array. Depending on the flag `VBYTE64_NO_CLZ` it will call the function using
  * `CLZ` (COUNT LEADING ZEROES) or the one using comparison.
  */
-size_t vb64d_compressed_size(const uint64_t *v, size_t n);
+VBYTE64_API size_t vb64d_compressed_size(const uint64_t *v, size_t n);
 
 /*
  * Calculate the exact size required to compress array `v` of size `n`.
@@ -30,7 +128,13 @@ size_t vb64d_compressed_size(const uint64_t *v, size_t n);
  * array. Depending on the flag `VBYTE64_NO_CLZ` it will call the function using
  * `CLZ` (COUNT LEADING ZEROES) or the one using comparison.
  */
-size_t vb64_compressed_size(const uint64_t *v, size_t n);
+VBYTE64_API size_t vb64_compressed_size(const uint64_t *v, size_t n);
+
+/*
+ * Calculate the exact size required to compress array `v` of size `n`
+ * using zigzag delta variable byte encoding (see `vb64_compress_zdelta`).
+ */
+VBYTE64_API size_t vb64zd_compressed_size(const uint64_t *v, size_t n);
 
 /*
  * Compress data in vector `v` of size `n` using variable byte delta encoding.
@@ -39,7 +143,7 @@ size_t vb64_compressed_size(const uint64_t *v, size_t n);
  * Returns a pointer of `uint8_t` containing the compressed data.
  * Return `NULL` if allocation of the uncompressed array fails.
  */
-uint8_t *vb64_compress_delta(uint64_t *v, size_t n, size_t *clen);
+VBYTE64_API uint8_t *vb64_compress_delta(uint64_t *v, size_t n, size_t *clen);
 
 /*
  * Compress data in vector `v` of size `n` using variable byte encoding.
@@ -48,7 +152,7 @@ uint8_t *vb64_compress_delta(uint64_t *v, size_t n, size_t *clen);
  * Returns a pointer of `uint8_t` containing the compressed data.
  * Return `NULL` if allocation of the uncompressed array fails.
  */
-uint8_t *vb64_compress(uint64_t *v, size_t n, size_t *clen);
+VBYTE64_API uint8_t *vb64_compress(uint64_t *v, size_t n, size_t *clen);
 
 /*
  * Compress data in vector `v` of size `n` using variable byte delta encoding.
@@ -62,7 +166,8 @@ uint8_t *vb64_compress(uint64_t *v, size_t n, size_t *clen);
  * Note: this function allocate more bytes than necessary in most cases
  * (for padding purposes), this are left in the allocation.
  */
-uint8_t *vb64_compress_delta_wl(uint64_t *v, size_t n, size_t *clen);
+VBYTE64_API uint8_t *vb64_compress_delta_wl(uint64_t *v, size_t n,
+                                            size_t *clen);
 
 /*
  * Compress data in vector `v` of size `n` using variable byte encoding.
@@ -76,21 +181,94 @@ uint8_t *vb64_compress_delta_wl(uint64_t *v, size_t n, size_t *clen);
  * Note: this function allocate more bytes than necessary in most cases
  * (for padding purposes), this are left in the allocation.
  */
-uint8_t *vb64_compress_wl(uint64_t *v, size_t n, size_t *clen);
+VBYTE64_API uint8_t *vb64_compress_wl(uint64_t *v, size_t n, size_t *clen);
+
+/*
+ * Compress data in vector `v` of size `n` using zigzag delta encoding, for
+ * sequences that are not strictly increasing: the difference with the
+ * previous value is taken as signed and mapped to 2|d| (2|d| - 1 when
+ * negative), so that small decreases cost as little as small increases.
+ * The `_wl` version stores the length of the array in the first
+ * `sizeof(size_t)` bytes. If provided, `clen` will be set to total number of
+ * used bytes in the compression phase.
+ *
+ * Returns `NULL` if allocation of the compressed array fails.
+ */
+VBYTE64_API uint8_t *vb64_compress_zdelta(uint64_t *v, size_t n, size_t *clen);
+VBYTE64_API uint8_t *vb64_compress_zdelta_wl(uint64_t *v, size_t n,
+                                             size_t *clen);
+
+/*
+ * Upper bound of the size required to compress any array of size `n`,
+ * padding included. Buffers of this size can be encoded without computing
+ * the exact size first.
+ */
+VBYTE64_API size_t vb64_max_compressed_size(size_t n);
+
+/*
+ * Single-pass versions of `vb64_compress_delta`, `vb64_compress`,
+ * `vb64_compress_delta_wl` and `vb64_compress_wl`.
+ * Instead of scanning `v` once to compute the exact size and once to encode
+ * it, these allocate `vb64_max_compressed_size(n)` bytes (plus the length for
+ * the `_wl` versions) and encode right away, halving the reads of `v`.
+ * If `shrink` is non-zero the allocation is then reduced to the used bytes
+ * plus `VBYTE64_PADDING`, otherwise the unused bytes are left in the
+ * allocation.
+ * If provided, `clen` will be set to total number of used bytes in the
+ * compression phase.
+ *
+ * Returns a pointer of `uint8_t` containing the compressed data, in the same
+ * format as the two-pass versions.
+ * Returns `NULL` if allocation of the compressed array fails.
+ */
+VBYTE64_API uint8_t *vb64_compress_delta_onepass(uint64_t *v, size_t n,
+                                                 size_t *clen, int shrink);
+VBYTE64_API uint8_t *vb64_compress_onepass(uint64_t *v, size_t n, size_t *clen,
+                                           int shrink);
+VBYTE64_API uint8_t *vb64_compress_delta_wl_onepass(uint64_t *v, size_t n,
+                                                    size_t *clen, int shrink);
+VBYTE64_API uint8_t *vb64_compress_wl_onepass(uint64_t *v, size_t n,
+                                              size_t *clen, int shrink);
+
+/*
+ * Compress data in vector `v` of size `n` into the caller provided buffer
+ * `out` of `cap` bytes, using variable byte delta encoding (`_delta`),
+ * variable byte encoding, and storing the length of the array in the first
+ * `sizeof(size_t)` bytes (`_wl`).
+ * `cap` must be at least the size returned by `vb64d_compressed_size` or
+ * `vb64_compressed_size` (plus `sizeof(size_t)` for the `_wl` versions).
+ * When `cap` is at least `vb64_max_compressed_size(n)` (plus the length) the
+ * exact size is not computed and `v` is read only once.
+ *
+ * Returns the number of bytes used in `out`, the same as `clen` in the
+ * allocating versions.
+ * Returns 0 if `cap` is too small, in that case `out` is left untouched.
+ * An empty array takes no bytes without its length: the versions without
+ * `_wl` return 0 for `n` equal to 0 whatever `cap`, and that is not a
+ * failure as there is nothing to write.
+ */
+VBYTE64_API size_t vb64_compress_delta_into(uint64_t *v, size_t n, uint8_t *out,
+                                            size_t cap);
+VBYTE64_API size_t vb64_compress_into(uint64_t *v, size_t n, uint8_t *out,
+                                      size_t cap);
+VBYTE64_API size_t vb64_compress_delta_wl_into(uint64_t *v, size_t n,
+                                               uint8_t *out, size_t cap);
+VBYTE64_API size_t vb64_compress_wl_into(uint64_t *v, size_t n, uint8_t *out,
+                                         size_t cap);
 
 /*
  * Decompress data in vector `in` of size `n` using variable byte delta decoding.
  * This version requires to know the length of the compressed array and the
  * `out` array should be already allocated.
  */
-void vb64_decompress_delta(uint8_t *in, uint64_t *out, size_t n);
+VBYTE64_API void vb64_decompress_delta(uint8_t *in, uint64_t *out, size_t n);
 
 /*
  * Decompress data in vector `in` of size `n` using variable byte decoding.
  * This version requires to know the length of the compressed array and the
  * `out` array should be already allocated.
  */
-void vb64_decompress(uint8_t *in, uint64_t *out, size_t n);
+VBYTE64_API void vb64_decompress(uint8_t *in, uint64_t *out, size_t n);
 
 /*
  * Decompress data in vector `in` using variable byte delta decoding of unknown size.
@@ -100,7 +278,7 @@ void vb64_decompress(uint8_t *in, uint64_t *out, size_t n);
  * data to store the length of the array.
  * Return `NULL` if allocation of the uncompressed array fails.
  */
-uint64_t *vb64_decompress_delta_wl(uint8_t *in, size_t *n);
+VBYTE64_API uint64_t *vb64_decompress_delta_wl(uint8_t *in, size_t *n);
 
 /*
  * Decompress data in vector `in` using variable byte decoding of unknown size.
@@ -110,34 +288,719 @@ uint64_t *vb64_decompress_delta_wl(uint8_t *in, size_t *n);
  * data to store the length of the array.
  * Return `NULL` if allocation of the uncompressed array fails.
  */
-uint64_t *vb64_decompress_wl(uint8_t *in, size_t *n);
+VBYTE64_API uint64_t *vb64_decompress_wl(uint8_t *in, size_t *n);
+
+/*
+ * Decompress data compressed by `vb64_compress_zdelta` (of size `n`) into
+ * `out`, or by `vb64_compress_zdelta_wl` into a new array whose length is
+ * stored in `n`. The zigzag mapping is undone inside the vectorized prefix
+ * sum.
+ * Return `NULL` if allocation of the uncompressed array fails.
+ */
+VBYTE64_API void vb64_decompress_zdelta(uint8_t *in, uint64_t *out, size_t n);
+VBYTE64_API uint64_t *vb64_decompress_zdelta_wl(uint8_t *in, size_t *n);
+
+/*
+ * Aggregates of the `n` values compressed in `in` by `vb64_compress` or, for
+ * the `_delta` versions, by `vb64_compress_delta`, computed while decoding
+ * without writing the values anywhere: they are unpacked one L1 sized block
+ * at the time in a stack buffer and folded into the result.
+ * `vb64_sum` returns the sum of the values (modulo 2^64).
+ * `vb64_minmax` stores the smallest and largest value in `min` and `max`,
+ * `UINT64_MAX` and 0 when `n` is 0.
+ * `vb64_count_range` returns the number of values in [`lo`, `hi`).
+ */
+VBYTE64_API uint64_t vb64_sum(uint8_t *in, size_t n);
+VBYTE64_API uint64_t vb64_sum_delta(uint8_t *in, size_t n);
+VBYTE64_API void vb64_minmax(uint8_t *in, size_t n, uint64_t *min,
+                             uint64_t *max);
+VBYTE64_API void vb64_minmax_delta(uint8_t *in, size_t n, uint64_t *min,
+                                   uint64_t *max);
+VBYTE64_API size_t vb64_count_range(uint8_t *in, size_t n, uint64_t lo,
+                                    uint64_t hi);
+VBYTE64_API size_t vb64_count_range_delta(uint8_t *in, size_t n, uint64_t lo,
+                                          uint64_t hi);
+
+/*
+ * Decompress data in vector `in`, of unknown size, into the caller provided
+ * array `out` of `cap` elements, using variable byte delta decoding
+ * (`_delta`) or variable byte decoding.
+ * `n` is set to the retrieved lenght of the array, stored in the first
+ * `sizeof(size_t)` bytes of the compressed data.
+ *
+ * Returns `out`.
+ * Returns `NULL` if the array does not fit in `cap` elements, `n` is set
+ * anyway so that the caller can grow `out` and retry.
+ */
+VBYTE64_API uint64_t *vb64_decompress_delta_wl_into(uint8_t *in, size_t *n,
+                                                    uint64_t *out, size_t cap);
+VBYTE64_API uint64_t *vb64_decompress_wl_into(uint8_t *in, size_t *n,
+                                              uint64_t *out, size_t cap);
+
+/*
+ * Variable byte encoding of 32-bit (`vb32`) and 16-bit (`vb16`) elements,
+ * without widening them to 64 bits. The codes take 2 bits (1 to 4 bytes) for
+ * 32-bit elements and 1 bit (1 or 2 bytes) for 16-bit ones, so that a key
+ * byte holds the codes of 4 or 8 values, whose data (at most 16 bytes) is
+ * packed and unpacked with a single shuffle. A zero takes one byte.
+ * The functions behave as their `vb64` counterparts: `d_compressed_size`
+ * is the exact size of the delta encoding, `_wl` variants store the length of
+ * the array in the first `sizeof(size_t)` bytes, and compressed buffers are
+ * followed by `VBYTE64_PADDING` bytes.
+ * Functions allocating return `NULL` if allocation fails.
+ */
+VBYTE64_API size_t vb32_compressed_size(const uint32_t *v, size_t n);
+VBYTE64_API size_t vb32d_compressed_size(const uint32_t *v, size_t n);
+VBYTE64_API size_t vb32_max_compressed_size(size_t n);
+VBYTE64_API uint8_t *vb32_compress(uint32_t *v, size_t n, size_t *clen);
+VBYTE64_API uint8_t *vb32_compress_delta(uint32_t *v, size_t n, size_t *clen);
+VBYTE64_API uint8_t *vb32_compress_wl(uint32_t *v, size_t n, size_t *clen);
+VBYTE64_API uint8_t *vb32_compress_delta_wl(uint32_t *v, size_t n,
+                                            size_t *clen);
+VBYTE64_API void vb32_decompress(uint8_t *in, uint32_t *out, size_t n);
+VBYTE64_API void vb32_decompress_delta(uint8_t *in, uint32_t *out, size_t n);
+VBYTE64_API uint32_t *vb32_decompress_wl(uint8_t *in, size_t *n);
+VBYTE64_API uint32_t *vb32_decompress_delta_wl(uint8_t *in, size_t *n);
+
+VBYTE64_API size_t vb16_compressed_size(const uint16_t *v, size_t n);
+VBYTE64_API size_t vb16d_compressed_size(const uint16_t *v, size_t n);
+VBYTE64_API size_t vb16_max_compressed_size(size_t n);
+VBYTE64_API uint8_t *vb16_compress(uint16_t *v, size_t n, size_t *clen);
+VBYTE64_API uint8_t *vb16_compress_delta(uint16_t *v, size_t n, size_t *clen);
+VBYTE64_API uint8_t *vb16_compress_wl(uint16_t *v, size_t n, size_t *clen);
+VBYTE64_API uint8_t *vb16_compress_delta_wl(uint16_t *v, size_t n,
+                                            size_t *clen);
+VBYTE64_API void vb16_decompress(uint8_t *in, uint16_t *out, size_t n);
+VBYTE64_API void vb16_decompress_delta(uint8_t *in, uint16_t *out, size_t n);
+VBYTE64_API uint16_t *vb16_decompress_wl(uint8_t *in, size_t *n);
+VBYTE64_API uint16_t *vb16_decompress_delta_wl(uint8_t *in, size_t *n);
+
+/*
+ * Inline decoders for arrays written by `vb64_compress(_delta)` (or the
+ * `vb32_` and `vb16_` ones) for the same `n`. Below `VBYTE64_SMALL` values
+ * they decode with a scalar loop that skips the kernel dispatch and the tail
+ * handling of the general decoders, unrolled in the caller when `n` is a
+ * constant, larger arrays are handed to the general decoders. As these, they
+ * never read past the data.
+ * The limit is where the two break even: from 16 values on, the pair kernels
+ * of the general decoders are faster than the scalar loop, twice as fast on
+ * plain arrays of 20 to 31 values.
+ */
+#define VBYTE64_SMALL 16
+
+// `width` and `delta` are constant in every caller, so that each decoder is
+// specialized on them
+static inline __attribute__((always_inline)) void
+vb64_decode_small_(const uint8_t *in, void *out, size_t n, int width,
+                   int delta) {
+  const int bits = width == 64 ? 4 : width == 32 ? 2 : 1, group = 8 / bits;
+  const unsigned mask = (1U << bits) - 1, base = width == 64 ? 0 : 1;
+#define VBYTE64_SMALL_LEN(i)                                                   \
+  (base + (in[(i) / group] >> ((i) % group) * bits & mask))
+#define VBYTE64_SMALL_PUT(i, val)                                              \
+  do {                                                                         \
+    if (width == 64)                                                           \
+      ((uint64_t *)out)[i] = val;                                              \
+    else if (width == 32)                                                      \
+      ((uint32_t *)out)[i] = (uint32_t)val;                                    \
+    else                                                                       \
+      ((uint16_t *)out)[i] = (uint16_t)val;                                    \
+  } while (0)
+  const uint8_t *data_p = in + (n + group - 1) / group;
+
+  // values starting at least 8 bytes before the end are read with one 8 bytes
+  // load, the last ones from a copy of the last bytes
+  size_t safe = n, tail = 0;
+  while (safe && tail < 8) {
+    --safe;
+    tail += VBYTE64_SMALL_LEN(safe);
+  }
+  uint64_t prev = 0, val;
+  size_t i = 0;
+  for (; i < safe; ++i) {
+    unsigned len = VBYTE64_SMALL_LEN(i);
+    __builtin_memcpy(&val, data_p, sizeof(val));
+    val = len < 8 ? val & ((1ULL << 8 * len) - 1) : val;
+    data_p += len;
+    val = prev = delta ? prev + val : val;
+    VBYTE64_SMALL_PUT(i, val);
+  }
+  uint8_t buf[16 + 8] = {0};
+  __builtin_memcpy(buf, data_p, tail);
+  data_p = buf;
+  for (; i < n; ++i) {
+    unsigned len = VBYTE64_SMALL_LEN(i);
+    __builtin_memcpy(&val, data_p, sizeof(val));
+    val = len < 8 ? val & ((1ULL << 8 * len) - 1) : val;
+    data_p += len;
+    val = prev = delta ? prev + val : val;
+    VBYTE64_SMALL_PUT(i, val);
+  }
+#undef VBYTE64_SMALL_PUT
+#undef VBYTE64_SMALL_LEN
+}
+
+static inline void vb64_decompress_small(const uint8_t *in, uint64_t *out,
+                                         size_t n) {
+  if (n >= VBYTE64_SMALL)
+    vb64_decompress((uint8_t *)in, out, n);
+  else
+    vb64_decode_small_(in, out, n, 64, 0);
+}
+
+static inline void vb64_decompress_delta_small(const uint8_t *in,
+                                               uint64_t *out, size_t n) {
+  if (n >= VBYTE64_SMALL)
+    vb64_decompress_delta((uint8_t *)in, out, n);
+  else
+    vb64_decode_small_(in, out, n, 64, 1);
+}
+
+static inline void vb32_decompress_small(const uint8_t *in, uint32_t *out,
+                                         size_t n) {
+  if (n >= VBYTE64_SMALL)
+    vb32_decompress((uint8_t *)in, out, n);
+  else
+    vb64_decode_small_(in, out, n, 32, 0);
+}
+
+static inline void vb32_decompress_delta_small(const uint8_t *in,
+                                               uint32_t *out, size_t n) {
+  if (n >= VBYTE64_SMALL)
+    vb32_decompress_delta((uint8_t *)in, out, n);
+  else
+    vb64_decode_small_(in, out, n, 32, 1);
+}
+
+static inline void vb16_decompress_small(const uint8_t *in, uint16_t *out,
+                                         size_t n) {
+  if (n >= VBYTE64_SMALL)
+    vb16_decompress((uint8_t *)in, out, n);
+  else
+    vb64_decode_small_(in, out, n, 16, 0);
+}
+
+static inline void vb16_decompress_delta_small(const uint8_t *in,
+                                               uint16_t *out, size_t n) {
+  if (n >= VBYTE64_SMALL)
+    vb16_decompress_delta((uint8_t *)in, out, n);
+  else
+    vb64_decode_small_(in, out, n, 16, 1);
+}
+
+/*
+ * Compress data in vector `v` of size `n` in blocks of `VBYTE64_BLOCK_SIZE`
+ * values, using variable byte delta encoding (`_delta`) or variable byte
+ * encoding.
+ * The compressed data starts with the length of the array, the block size and
+ * the mode, followed by a skip index storing for every block the offset of
+ * its data and, in delta mode, the value preceding it. Any value can then be
+ * retrieved by decoding at most one block.
+ * If provided, `clen` will be set to total number of used bytes in the
+ * compression phase.
+ *
+ * Returns a pointer of `uint8_t` containing the compressed data.
+ * Returns `NULL` if allocation of the compressed array fails.
+ */
+VBYTE64_API uint8_t *vb64b_compress_delta(uint64_t *v, size_t n, size_t *clen);
+VBYTE64_API uint8_t *vb64b_compress(uint64_t *v, size_t n, size_t *clen);
+
+/*
+ * Same as `vb64b_compress`, choosing for every block the encoding using the
+ * fewest bytes: plain, delta (from the first value of the block), frame of
+ * reference (values minus the smallest one of the block) or constant (no
+ * data at all). The mode of each block is kept in the skip index, so that
+ * mixed arrays, for example sorted with unsorted parts, can be decoded,
+ * retrieved by range or index like any other blocked array.
+ */
+VBYTE64_API uint8_t *vb64b_compress_adaptive(uint64_t *v, size_t n,
+                                             size_t *clen);
+
+/*
+ * Returns the length of the array compressed in blocks in `in`.
+ */
+VBYTE64_API size_t vb64b_len(const uint8_t *in);
+
+/*
+ * Decompress the whole array compressed in blocks in `in`, whatever its mode.
+ * Provide a valid pointer to a variable `n` to store the retrieved lenght of
+ * the array. Returns a pointer of `uint64_t` containing the uncompressed data.
+ * Return `NULL` if allocation of the uncompressed array fails.
+ */
+VBYTE64_API uint64_t *vb64b_decompress(uint8_t *in, size_t *n);
+
+/*
+ * Decompress the values of index `lo` up to `hi` (excluded) of the array
+ * compressed in blocks in `in` into `out`, that must hold `hi - lo` values.
+ * `hi` is clamped to the length of the array.
+ *
+ * Returns the number of values written to `out`.
+ */
+VBYTE64_API size_t vb64b_decode_range(const uint8_t *in, size_t lo, size_t hi,
+                                      uint64_t *out);
+
+/*
+ * Returns the value of index `i` of the array compressed in blocks in `in`,
+ * `i` must be smaller than its length.
+ */
+VBYTE64_API uint64_t vb64b_get(const uint8_t *in, size_t i);
+
+/*
+ * Search the sorted array compressed by `vb64b_compress_delta` in `in` for
+ * the first value not smaller than `x`.
+ * The skip index is binary searched to find the only block that can hold it,
+ * then only that block is decoded.
+ * If provided, `val` is set to the value found.
+ *
+ * Returns the index of the value found, or the length of the array if all
+ * the values are smaller than `x` or `in` was compressed by any other
+ * function (its block bases are not the values preceding the blocks).
+ */
+VBYTE64_API size_t vb64b_lower_bound(const uint8_t *in, uint64_t x,
+                                     uint64_t *val);
+
+/*
+ * Intersection and union of two sorted arrays compressed in blocks in `a`
+ * and `b`, computed without decompressing them.
+ * Values are decoded one block at the time and, for the intersection of
+ * arrays compressed by `vb64b_compress_delta`, the skip index is galloped to
+ * jump over the blocks that cannot match. The blocks of the other modes are
+ * all decoded.
+ * Repeated values are kept as many times as they appear in both arrays
+ * (intersection) or in either of them (union).
+ *
+ * The plain versions write the result to `out`, that must hold the length of
+ * the shorter array (intersection) or the sum of the two lengths (union), and
+ * return the number of values written.
+ * The `_delta` versions return the result compressed as by
+ * `vb64b_compress_delta`, setting `clen` (if provided) to the number of used
+ * bytes, or `NULL` if allocation of the compressed array fails.
+ */
+VBYTE64_API size_t vb64b_intersect(const uint8_t *a, const uint8_t *b,
+                                   uint64_t *out);
+VBYTE64_API size_t vb64b_union(const uint8_t *a, const uint8_t *b,
+                               uint64_t *out);
+VBYTE64_API uint8_t *vb64b_intersect_delta(const uint8_t *a, const uint8_t *b,
+                                           size_t *clen);
+VBYTE64_API uint8_t *vb64b_union_delta(const uint8_t *a, const uint8_t *b,
+                                       size_t *clen);
+
+/*
+ * Multithreaded versions of `vb64_compress_delta`, `vb64_compress`,
+ * `vb64_compress_delta_wl` and `vb64_compress_wl`.
+ * `v` is split in one chunk per thread, the chunks are sized and encoded
+ * concurrently (each delta chunk starting from the last value of the
+ * previous one) and placed with a prefix sum of their sizes, so the output
+ * is identical to the single threaded one.
+ * `nthreads` up to 0 uses one thread per online CPU, fewer threads are used
+ * when `n` is too small to be worth splitting.
+ */
+VBYTE64_API uint8_t *vb64_compress_delta_mt(uint64_t *v, size_t n, size_t *clen,
+                                            int nthreads);
+VBYTE64_API uint8_t *vb64_compress_mt(uint64_t *v, size_t n, size_t *clen,
+                                      int nthreads);
+VBYTE64_API uint8_t *vb64_compress_delta_wl_mt(uint64_t *v, size_t n,
+                                               size_t *clen, int nthreads);
+VBYTE64_API uint8_t *vb64_compress_wl_mt(uint64_t *v, size_t n, size_t *clen,
+                                         int nthreads);
+
+/*
+ * Multithreaded versions of `vb64_decompress_delta`, `vb64_decompress`,
+ * `vb64_decompress_delta_wl` and `vb64_decompress_wl`, working on data
+ * compressed by any of the compression functions.
+ * The chunk offset table is rebuilt from the keys, then the chunks are
+ * decoded concurrently. In delta decoding every chunk is then shifted by the
+ * last value of the previous ones.
+ */
+VBYTE64_API void vb64_decompress_delta_mt(uint8_t *in, uint64_t *out, size_t n,
+                                          int nthreads);
+VBYTE64_API void vb64_decompress_mt(uint8_t *in, uint64_t *out, size_t n,
+                                    int nthreads);
+VBYTE64_API uint64_t *vb64_decompress_delta_wl_mt(uint8_t *in, size_t *n,
+                                                  int nthreads);
+VBYTE64_API uint64_t *vb64_decompress_wl_mt(uint8_t *in, size_t *n,
+                                            int nthreads);
 
 /*
- * Compress data in vector `v` of size `n` using variable byte encoding,
+ * Compress data in vector `v` of size `n` using variable byte delta encoding
+ * (`_delta`), zigzag delta encoding (`_zdelta`) or variable byte encoding,
  * writing directly to file `fpath`.
  * This version utilizes the first `sizeof(size_t)` bytes of the compressed
- * data to store the length of the array.
+ * data to store the length of the array, the file has the same content as
+ * the output of `vb64_compress_delta_wl` (or `vb64_compress_zdelta_wl`,
+ * `vb64_compress_wl`).
+ * The keys and the data are encoded in large in-memory steps, each one
+ * written with a single `pwrite`.
  * 
  * Returns the number of bytes wrote to file. 
- *
- * NOTE: If a file write fails, the program exit with EXIT_FAILURE.
+ * Returns 0 if the file cannot be opened or written, `errno` tells why.
  */
-size_t vb64f_compress_delta(uint64_t *v, size_t n, const char* fpath);
+VBYTE64_API size_t vb64f_compress_delta(uint64_t *v, size_t n,
+                                        const char* fpath);
+VBYTE64_API size_t vb64f_compress_zdelta(uint64_t *v, size_t n,
+                                         const char *fpath);
+VBYTE64_API size_t vb64f_compress(uint64_t *v, size_t n, const char *fpath);
 
 /*
- * Decompress data in file `fpath` using variable byte delta decoding.
+ * Decompress data in file `fpath` using variable byte delta decoding
+ * (`_delta`), zigzag delta decoding (`_zdelta`) or variable byte decoding.
  * Provide a valid pointer to a variable `n` to store the retrieved lenght of
  * the array. 
  *
  * Returns a pointer of `uint64_t` containing the uncompressed data.
- * Return `NULL` if allocation of the uncompressed array fails.
+ * Return `NULL` if the file cannot be read or allocation of the uncompressed
+ * array fails.
+ */
+VBYTE64_API uint64_t *vb64f_decompress_delta(const char *fpath, size_t *n);
+VBYTE64_API uint64_t *vb64f_decompress_zdelta(const char *fpath, size_t *n);
+VBYTE64_API uint64_t *vb64f_decompress(const char *fpath, size_t *n);
+
+/*
+ * Same as `vb64f_compress_delta`, `vb64f_compress_zdelta` and
+ * `vb64f_compress`, writing to the already open file descriptor `fd` at
+ * offset `off`. The file offset of `fd` is not changed, so many arrays can be
+ * appended to the same file by advancing `off` by the returned size.
+ */
+VBYTE64_API size_t vb64fd_compress_delta(uint64_t *v, size_t n, int fd,
+                                         off_t off);
+VBYTE64_API size_t vb64fd_compress_zdelta(uint64_t *v, size_t n, int fd,
+                                          off_t off);
+VBYTE64_API size_t vb64fd_compress(uint64_t *v, size_t n, int fd, off_t off);
+
+/*
+ * Same as `vb64f_decompress_delta`, `vb64f_decompress_zdelta` and
+ * `vb64f_decompress`, reading from the already open file descriptor `fd` at
+ * offset `off`.
+ * If provided, `clen` is set to the number of compressed bytes read, the
+ * offset of the next array in the file is then `off + clen`.
+ */
+VBYTE64_API uint64_t *vb64fd_decompress_delta(int fd, off_t off, size_t *n,
+                                              size_t *clen);
+VBYTE64_API uint64_t *vb64fd_decompress_zdelta(int fd, off_t off, size_t *n,
+                                               size_t *clen);
+VBYTE64_API uint64_t *vb64fd_decompress(int fd, off_t off, size_t *n,
+                                        size_t *clen);
+
+/*
+ * Load the `count` files `fpaths`, written by `vb64f_compress_delta` (for
+ * `vb64f_load_delta`) or `vb64f_compress` (for `vb64f_load`), keeping many
+ * reads in flight through io_uring, or a pool of threads calling `pread`
+ * when io_uring is not available (or the environment variable
+ * `VBYTE64_NO_URING` is set).
+ * Files are decoded on the calling thread as their reads complete, while
+ * the next ones are read, and handed to `done` in completion order with
+ * their index `i` in `fpaths`. The caller owns `v`, allocated like the
+ * output of `vb64_decompress_delta`; `v` is NULL if the file cannot be read
+ * or is truncated.
  *
- * NOTE: If a file read fails, the program exit with EXIT_FAILURE.
+ * Returns 0 if every file was loaded, -1 otherwise.
  */
-uint64_t *vb64f_decompress_delta(const char *fpath, size_t *n);
+VBYTE64_API int
+vb64f_load_delta(const char *const *fpaths, size_t count,
+                 void (*done)(size_t i, uint64_t *v, size_t n, void *ud),
+                 void *ud);
+VBYTE64_API int
+vb64f_load(const char *const *fpaths, size_t count,
+           void (*done)(size_t i, uint64_t *v, size_t n, void *ud),
+           void *ud);
+
+/*
+ * Read-only memory mapping of a file written by `vb64f_compress_delta` (or
+ * any file holding the `_wl` layout), sharing the page cache between
+ * processes and never copying the compressed data.
+ * `key_p` and `data_p` point to the two streams inside the mapping, `n` is
+ * the length of the array. The mapping is followed by at least
+ * `VBYTE64_PADDING` zero bytes, so it can be decoded like an in-memory
+ * compressed array.
+ */
+struct vb64f_mapping {
+  uint8_t *base;
+  size_t size, map_size, n;
+  const uint8_t *key_p, *data_p;
+};
+
+/*
+ * Map the file `fpath` into `m`.
+ * The keys are read once to check that they do not ask for more data than
+ * the file holds, so mapping faults in the pages of the key stream (a
+ * sixteenth of the size of the decoded array) though not the data.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the file cannot be opened or mapped, or it is too short for
+ * the length, the keys or the data it stores, `errno` tells why.
+ */
+VBYTE64_API int vb64f_map(const char *fpath, struct vb64f_mapping *m);
+
+/*
+ * Release the mapping `m`, the pointers it holds become invalid.
+ */
+VBYTE64_API void vb64f_unmap(struct vb64f_mapping *m);
+
+/*
+ * Decompress the mapped file `m` into `out`, that must hold `m->n` values,
+ * using variable byte delta decoding (`_delta`) or variable byte decoding.
+ */
+VBYTE64_API void vb64f_map_decompress_delta(const struct vb64f_mapping *m,
+                                            uint64_t *out);
+VBYTE64_API void vb64f_map_decompress(const struct vb64f_mapping *m,
+                                      uint64_t *out);
+
+/*
+ * Streaming encoder, for inputs that do not fit in memory or whose length is
+ * not known in advance.
+ * Values pushed in batches of any size are encoded in frames of up to
+ * `VBYTE64_STREAM_FRAME` values, each one made of the number of values and
+ * the number of data bytes (both `uint32_t`), the keys and the data.
+ * The delta base and the half filled key byte are carried across batches and
+ * frames, and an empty frame marks the end of the stream.
+ * Complete frames are handed to `write`, that must return the number of
+ * bytes written, anything other than `len` is an error.
+ */
+struct vb64s_encoder {
+  size_t (*write)(const void *buf, size_t len, void *ud);
+  void *ud;
+  int delta, err;
+  uint64_t prev;
+  size_t count;
+  uint8_t *frame, *data_p;
+};
+
+/*
+ * Initialize `e`, using variable byte delta encoding if `delta` is non-zero.
+ * Returns 0 on success, -1 if allocation of the frame buffer fails.
+ */
+VBYTE64_API int
+vb64s_encoder_init(struct vb64s_encoder *e, int delta,
+                   size_t (*write)(const void *buf, size_t len, void *ud),
+                   void *ud);
+
+/*
+ * Append the `n` values of `v` to the stream.
+ * Returns 0 on success, -1 if a write failed (now or before).
+ */
+VBYTE64_API int vb64s_push(struct vb64s_encoder *e, const uint64_t *v,
+                           size_t n);
+
+/*
+ * Write the last frame and the end marker, then release the buffers of `e`.
+ * Returns 0 on success, -1 if a write failed (now or before).
+ */
+VBYTE64_API int vb64s_finish(struct vb64s_encoder *e);
+
+/*
+ * Pull based decoder of the streams written by `vb64s_encoder`, reading one
+ * frame at the time through `read`, that must return the number of bytes
+ * read, anything other than `len` is an error.
+ * `delta` must match the one of the encoder.
+ */
+struct vb64s_decoder {
+  size_t (*read)(void *buf, size_t len, void *ud);
+  void *ud;
+  int delta, err, done;
+  uint64_t prev;
+  size_t count, pos;
+  uint8_t *frame;
+  const uint8_t *key_p, *data_p;
+};
+
+/*
+ * Initialize `d`.
+ * Returns 0 on success, -1 if allocation of the frame buffer fails.
+ */
+VBYTE64_API int
+vb64s_decoder_init(struct vb64s_decoder *d, int delta,
+                   size_t (*read)(void *buf, size_t len, void *ud),
+                   void *ud);
+
+/*
+ * Decode up to `max` values of the stream into `out`.
+ * Returns the number of values decoded, less than `max` only at the end of
+ * the stream or on a read error (`d->err` is then -1).
+ */
+VBYTE64_API size_t vb64s_next(struct vb64s_decoder *d, uint64_t *out,
+                              size_t max);
+
+/*
+ * Release the buffers of `d`.
+ */
+VBYTE64_API void vb64s_decoder_free(struct vb64s_decoder *d);
+
+/*
+ * Container file holding many independent arrays, each one found by an `id`.
+ * The file starts with a header (magic, version, number of arrays and offset
+ * of the directory), followed by the arrays in the `_wl` layout and by the
+ * directory, sorted by id.
+ */
+enum vb64c_mode { vb64c_plain = 0, vb64c_delta = 1, vb64c_zdelta = 2 };
+
+/*
+ * Directory entry of an array: its id, length, offset and size of its
+ * payload in the file, encoding mode, smallest and largest value.
+ */
+struct vb64c_entry {
+  uint64_t id, n, off, size;
+  uint32_t mode, reserved;
+  uint64_t min, max;
+};
+
+/*
+ * Writer of a container file, the payloads are written as the arrays are
+ * added, the directory and the header when the writer is finished.
+ */
+struct vb64c_writer {
+  int fd, err;
+  off_t off;
+  size_t count, cap;
+  struct vb64c_entry *dir;
+};
+
+/*
+ * Create or truncate the container file `fpath`.
+ * Returns 0 on success, -1 if the file cannot be opened.
+ */
+VBYTE64_API int vb64c_create(struct vb64c_writer *w, const char *fpath);
+
+/*
+ * Append the `n` values of `v` as the array `id`, using variable byte delta
+ * encoding if `mode` is `vb64c_delta`, zigzag delta encoding if it is
+ * `vb64c_zdelta`.
+ * Returns 0 on success, -1 if a write failed (now or before).
+ */
+VBYTE64_API int vb64c_add(struct vb64c_writer *w, uint64_t id,
+                          const uint64_t *v, size_t n, int mode);
+
+/*
+ * Write the directory and the header, close the file and release `w`.
+ * Returns 0 on success, -1 if a write failed or an id was added twice.
+ */
+VBYTE64_API int vb64c_finish(struct vb64c_writer *w);
+
+/*
+ * Read-only memory mapping of a container file, decoding an array only
+ * touches the pages of its own payload.
+ * `dir` points to the `count` entries of the directory, sorted by id.
+ */
+struct vb64c_reader {
+  uint8_t *base;
+  size_t size, map_size, count;
+  const struct vb64c_entry *dir;
+};
+
+/*
+ * Map the container file `fpath` into `r`.
+ * Only the header and the directory are read: every payload must lie
+ * between them and hold its keys.
+ * Returns 0 on success, -1 if the file cannot be opened or mapped, or it is
+ * not a valid container, `errno` tells why.
+ */
+VBYTE64_API int vb64c_open(const char *fpath, struct vb64c_reader *r);
+
+/*
+ * Release the mapping `r`, the entries it holds become invalid.
+ */
+VBYTE64_API void vb64c_close(struct vb64c_reader *r);
+
+/*
+ * Find the directory entry of the array `id`, NULL if there is none.
+ */
+VBYTE64_API const struct vb64c_entry *vb64c_find(const struct vb64c_reader *r,
+                                                 uint64_t id);
+
+/*
+ * Decompress the array of the entry `e` into `out`, that must hold `e->n`
+ * values. Its keys are first checked against the size of its payload, so
+ * that decoding never reads past it.
+ * Returns 0 on success, -1 (`errno` set to `EINVAL`) if the keys ask for more
+ * data than the payload holds.
+ */
+VBYTE64_API int vb64c_decompress_entry(const struct vb64c_reader *r,
+                                       const struct vb64c_entry *e,
+                                       uint64_t *out);
+
+/*
+ * Decompress the array `id` into a new buffer and set `n` to its length.
+ * Return NULL if there is no such array, its payload is corrupt (see
+ * `vb64c_decompress_entry`) or allocation fails.
+ */
+VBYTE64_API uint64_t *vb64c_decompress(const struct vb64c_reader *r,
+                                       uint64_t id, size_t *n);
+
+/*
+ * Grouped key format, for data whose values mostly take a few byte lengths.
+ * Keys are 2-bit codes, four values per key byte, mapped to the byte lengths
+ * of a code table `lens`: four increasing lengths ending with 8, for example
+ * {1, 2, 4, 8} (the default when `lens` is NULL) or {0, 1, 2, 8}. A value
+ * takes the smallest length it fits in.
+ * The compressed buffer holds the length of the array (`size_t`), the code
+ * table (4 bytes), the keys and the data.
+ */
+
+/*
+ * Calculate the exact size required to compress array `v` of size `n` with
+ * the code table `lens`, using delta encoding (`vb64gd_`) or not, header and
+ * padding included, to compare with `vb64d_compressed_size` and
+ * `vb64_compressed_size`.
+ * Returns 0 if `lens` is not a valid code table.
+ */
+VBYTE64_API size_t vb64gd_compressed_size(const uint64_t *v, size_t n,
+                                          const uint8_t *lens);
+VBYTE64_API size_t vb64g_compressed_size(const uint64_t *v, size_t n,
+                                         const uint8_t *lens);
+
+/*
+ * Compress data in vector `v` of size `n` with the code table `lens`, using
+ * delta encoding (`_delta`) or not.
+ * If provided, `clen` will be set to total number of used bytes, the
+ * allocation is followed by `VBYTE64_PADDING` bytes.
+ * Returns NULL if `lens` is not a valid code table or allocation fails.
+ */
+VBYTE64_API uint8_t *vb64g_compress_delta(uint64_t *v, size_t n,
+                                          const uint8_t *lens, size_t *clen);
+VBYTE64_API uint8_t *vb64g_compress(uint64_t *v, size_t n, const uint8_t *lens,
+                                    size_t *clen);
+
+/*
+ * Decompress a buffer written by `vb64g_compress_delta` or `vb64g_compress`,
+ * setting `n` to the length of the array.
+ * Returns NULL if the code table is not valid or allocation fails.
+ */
+VBYTE64_API uint64_t *vb64g_decompress_delta(const uint8_t *in, size_t *n);
+VBYTE64_API uint64_t *vb64g_decompress(const uint8_t *in, size_t *n);
+
+/*
+ * Extended delta format, for arrays with runs of repeated values or of
+ * constant strides. The key codes 0 to 8 keep their meaning, while codes 9 to
+ * 11 stand for a run of zero deltas and codes 12 to 14 for a run repeating
+ * the previous delta, whose length follows in the data in 1, 2 or 4 bytes.
+ * Code 15 is reserved. Runs shorter than 8 values are left to the plain
+ * codes, so the extended format is never larger than `vb64_compress_delta`
+ * (plus its header).
+ * The compressed buffer holds the length of the array, the number of codes
+ * and the number of data bytes (all `size_t`), the keys and the data.
+ */
+
+/*
+ * Compress data in vector `v` of size `n`.
+ * If provided, `clen` will be set to total number of used bytes, the buffer
+ * is followed by `VBYTE64_PADDING` bytes.
+ * Returns NULL if allocation fails.
+ */
+VBYTE64_API uint8_t *vb64x_compress_delta(uint64_t *v, size_t n, size_t *clen);
+
+/*
+ * Decompress a buffer written by `vb64x_compress_delta`, setting `n` to the
+ * length of the array. Stretches without runs are decoded by the SIMD
+ * decoder, runs are expanded with plain stores.
+ * Returns NULL if allocation fails.
+ */
+VBYTE64_API uint64_t *vb64x_decompress_delta(const uint8_t *in, size_t *n);
 
 #ifdef __cplusplus
 }
 #endif // __cplusplus
 
+#ifdef VBYTE64_HEADER_ONLY
+#include "vbyte64.c"
+#endif // VBYTE64_HEADER_ONLY
+
 #endif // !VBYTE64_H
@@ -0,0 +1,437 @@
+/*
+ * Template of the variable byte encoding for the narrow element types,
+ * included by vbyte64.c once per width with these parameters defined:
+ *
+ *   VBW_WIDTH      bits of an element, 32 or 16
+ *   VBW_TYPE       unsigned type of an element
+ *   VBW_CODE_BITS  bits of a code, 2 (lengths 1 to 4) or 1 (lengths 1 or 2)
+ *
+ * Every key byte holds the codes of a group of 8 / VBW_CODE_BITS values, low
+ * bits first, so that the data of a full group always fits in 16 bytes and is
+ * unpacked (or packed) by a single byte shuffle. Code `c` stands for `c + 1`
+ * data bytes, a zero takes one byte.
+ * The functions get the `vb<VBW_WIDTH>` prefix and mirror the ones of the
+ * 64-bit format, see vbyte64.h.
+ */
+
+#define VBW_CAT_(a, b, c) a##b##c
+#define VBW_CAT(a, b, c) VBW_CAT_(a, b, c)
+#define VBW_NAME(x) VBW_CAT(vb, VBW_WIDTH, x)
+
+#define VBW_BYTES (VBW_WIDTH / 8)
+#define VBW_GROUP (8 / VBW_CODE_BITS)
+#define VBW_CMASK ((1 << VBW_CODE_BITS) - 1)
+#define VBW_KEY_SIZE(n) (sizeof(uint8_t) * (((n) + VBW_GROUP - 1) / VBW_GROUP))
+
+#if VBW_WIDTH == 32
+#define VBW_ADD _mm_add_epi32
+#define VBW_SUB _mm_sub_epi32
+// broadcast of the last lane
+#define VBW_LAST(x) _mm_shuffle_epi32(x, 0xFF)
+#else
+#define VBW_ADD _mm_add_epi16
+#define VBW_SUB _mm_sub_epi16
+#define VBW_LAST(x) _mm_shuffle_epi32(_mm_shufflehi_epi16(x, 0xFF), 0xFF)
+#endif
+
+// Tables indexed by a full key byte, as the ones of the 64-bit format.
+// `mkey` maps the mask of the non-zero bytes of 8 bytes of input to the
+// codes of their lanes (4 bits of key).
+static uint8_t VBW_NAME(_klen)[256];
+static uint8_t VBW_NAME(_mkey)[256];
+#ifdef VBYTE64_X86
+static uint8_t VBW_NAME(_dec_shuf)[256][16] __attribute__((aligned(16)));
+static uint8_t VBW_NAME(_enc_shuf)[256][16] __attribute__((aligned(16)));
+#endif /* ifdef VBYTE64_X86 */
+
+static void VBW_NAME(_tables_init)(void) {
+  for (int k = 0; k < 256; ++k) {
+    uint8_t off = 0;
+#ifdef VBYTE64_X86
+    memset(VBW_NAME(_enc_shuf)[k], 0x80, 16);
+#endif /* ifdef VBYTE64_X86 */
+    for (int j = 0; j < VBW_GROUP; ++j) {
+      uint8_t l = ((k >> j * VBW_CODE_BITS) & VBW_CMASK) + 1;
+#ifdef VBYTE64_X86
+      for (int b = 0; b < VBW_BYTES; ++b)
+        VBW_NAME(_dec_shuf)[k][j * VBW_BYTES + b] = b < l ? off + b : 0x80;
+      for (int b = 0; b < l; ++b)
+        VBW_NAME(_enc_shuf)[k][off + b] = j * VBW_BYTES + b;
+#endif /* ifdef VBYTE64_X86 */
+      off += l;
+    }
+    VBW_NAME(_klen)[k] = off;
+
+    uint8_t mkey = 0;
+    for (int j = 0; j < 8 / VBW_BYTES; ++j) {
+      int bits = (k >> j * VBW_BYTES) & ((1 << VBW_BYTES) - 1);
+      mkey |= (bits ? 31 - __builtin_clz(bits) : 0) << j * VBW_CODE_BITS;
+    }
+    VBW_NAME(_mkey)[k] = mkey;
+  }
+}
+
+static inline uint8_t VBW_NAME(_code)(VBW_TYPE v) {
+  return (31 - __builtin_clz((uint32_t)v | 1)) >> 3;
+}
+
+// data bytes of the first `m` values of key byte `k`
+static inline size_t VBW_NAME(_plen)(uint8_t k, size_t m) {
+  size_t len = m;
+  for (size_t j = 0; j < m; ++j)
+    len += (k >> j * VBW_CODE_BITS) & VBW_CMASK;
+  return len;
+}
+
+static size_t VBW_NAME(_encode_size)(const VBW_TYPE *v, size_t n, int delta) {
+  size_t nbytes = n;
+  VBW_TYPE prev = 0;
+  for (size_t i = 0; i < n; ++i) {
+    nbytes += VBW_NAME(_code)(delta ? (VBW_TYPE)(v[i] - prev) : v[i]);
+    prev = v[i];
+  }
+  return nbytes;
+}
+
+size_t VBW_NAME(_compressed_size)(const VBW_TYPE *v, size_t n) {
+  return VBW_KEY_SIZE(n) + VBW_NAME(_encode_size)(v, n, 0) + VBYTE64_PADDING;
+}
+
+size_t VBW_NAME(d_compressed_size)(const VBW_TYPE *v, size_t n) {
+  return VBW_KEY_SIZE(n) + VBW_NAME(_encode_size)(v, n, 1) + VBYTE64_PADDING;
+}
+
+size_t VBW_NAME(_max_compressed_size)(size_t n) {
+  return VBW_KEY_SIZE(n) + sizeof(VBW_TYPE) * n + VBYTE64_PADDING;
+}
+
+// one key byte for the `m <= VBW_GROUP` values of `v`, `prev` being the
+// value preceding `v[0]` in delta mode
+static inline __attribute__((always_inline)) uint8_t *
+VBW_NAME(_enc_key)(uint8_t *key_p, uint8_t *data_p, const VBW_TYPE *v,
+                   size_t m, VBW_TYPE prev, int delta) {
+  uint8_t key = 0;
+  for (size_t j = 0; j < m; ++j) {
+    VBW_TYPE d = delta ? (VBW_TYPE)(v[j] - prev) : v[j];
+    uint8_t c = VBW_NAME(_code)(d);
+    memcpy(data_p, &d, c + 1);
+    data_p += c + 1;
+    key |= c << j * VBW_CODE_BITS;
+    prev = v[j];
+  }
+  *key_p = key;
+  return data_p;
+}
+
+// The group kernels follow the conventions of the 64-bit pair kernels:
+// `ngroups` full key bytes, SIMD ones may write (encoder) or read (decoder)
+// up to 16 bytes past the data of the last group.
+static uint8_t *VBW_NAME(_enc_groups_scalar)(uint8_t *key_p, uint8_t *data_p,
+                                             const VBW_TYPE *v, size_t ngroups,
+                                             VBW_TYPE prev) {
+  for (size_t i = 0; i < ngroups; ++i)
+    data_p = VBW_NAME(_enc_key)(key_p + i, data_p, v + i * VBW_GROUP,
+                                VBW_GROUP, 0, 0);
+  (void)prev;
+  return data_p;
+}
+
+static uint8_t *
+VBW_NAME(_enc_groups_delta_scalar)(uint8_t *key_p, uint8_t *data_p,
+                                   const VBW_TYPE *v, size_t ngroups,
+                                   VBW_TYPE prev) {
+  for (size_t i = 0; i < ngroups; ++i) {
+    data_p = VBW_NAME(_enc_key)(key_p + i, data_p, v + i * VBW_GROUP,
+                                VBW_GROUP, prev, 1);
+    prev = v[i * VBW_GROUP + VBW_GROUP - 1];
+  }
+  return data_p;
+}
+
+static inline __attribute__((always_inline)) const uint8_t *
+VBW_NAME(_dec_key)(uint8_t k, const uint8_t *data_p, VBW_TYPE *o, size_t m,
+                   VBW_TYPE prev, int delta) {
+  for (size_t j = 0; j < m; ++j) {
+    uint8_t l = ((k >> j * VBW_CODE_BITS) & VBW_CMASK) + 1;
+    VBW_TYPE val = 0;
+    memcpy(&val, data_p, l);
+    data_p += l;
+    o[j] = prev = delta ? (VBW_TYPE)(prev + val) : val;
+  }
+  return data_p;
+}
+
+static const uint8_t *VBW_NAME(_dec_groups_scalar)(const uint8_t *key_p,
+                                                   const uint8_t *data_p,
+                                                   VBW_TYPE *o, size_t ngroups,
+                                                   VBW_TYPE prev) {
+  for (size_t i = 0; i < ngroups; ++i)
+    data_p = VBW_NAME(_dec_key)(key_p[i], data_p, o + i * VBW_GROUP,
+                                VBW_GROUP, 0, 0);
+  (void)prev;
+  return data_p;
+}
+
+static const uint8_t *
+VBW_NAME(_dec_groups_delta_scalar)(const uint8_t *key_p, const uint8_t *data_p,
+                                   VBW_TYPE *o, size_t ngroups, VBW_TYPE prev) {
+  for (size_t i = 0; i < ngroups; ++i) {
+    data_p = VBW_NAME(_dec_key)(key_p[i], data_p, o + i * VBW_GROUP,
+                                VBW_GROUP, prev, 1);
+    prev = o[i * VBW_GROUP + VBW_GROUP - 1];
+  }
+  return data_p;
+}
+
+#ifdef VBYTE64_X86
+__attribute__((target("ssse3"))) static inline
+    __attribute__((always_inline)) uint8_t *
+    VBW_NAME(_enc_groups_ssse3_t)(uint8_t *key_p, uint8_t *data_p,
+                                  const VBW_TYPE *v, size_t ngroups,
+                                  VBW_TYPE prev, int delta) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i carry = _mm_set1_epi32(0);
+  if (delta)
+    carry = VBW_WIDTH == 32 ? _mm_set1_epi32(prev) : _mm_set1_epi16(prev);
+  for (size_t i = 0; i < ngroups; ++i) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(v + i * VBW_GROUP));
+    if (delta) {
+      // [prev, x0, x1, ...]
+      __m128i y = _mm_alignr_epi8(x, carry, 16 - VBW_BYTES);
+      carry = x;
+      x = VBW_SUB(x, y);
+    }
+    uint32_t nz = ~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero));
+    uint8_t k = VBW_NAME(_mkey)[nz & 0xFF] |
+                (VBW_NAME(_mkey)[(nz >> 8) & 0xFF] << 4);
+    __m128i s = _mm_load_si128((const __m128i *)VBW_NAME(_enc_shuf)[k]);
+    _mm_storeu_si128((__m128i *)data_p, _mm_shuffle_epi8(x, s));
+    data_p += VBW_NAME(_klen)[k];
+    key_p[i] = k;
+  }
+  return data_p;
+}
+
+__attribute__((target("ssse3"))) static uint8_t *
+VBW_NAME(_enc_groups_ssse3)(uint8_t *key_p, uint8_t *data_p, const VBW_TYPE *v,
+                            size_t ngroups, VBW_TYPE prev) {
+  return VBW_NAME(_enc_groups_ssse3_t)(key_p, data_p, v, ngroups, prev, 0);
+}
+
+__attribute__((target("ssse3"))) static uint8_t *
+VBW_NAME(_enc_groups_delta_ssse3)(uint8_t *key_p, uint8_t *data_p,
+                                  const VBW_TYPE *v, size_t ngroups,
+                                  VBW_TYPE prev) {
+  return VBW_NAME(_enc_groups_ssse3_t)(key_p, data_p, v, ngroups, prev, 1);
+}
+
+__attribute__((target("ssse3"))) static inline
+    __attribute__((always_inline)) const uint8_t *
+    VBW_NAME(_dec_groups_ssse3_t)(const uint8_t *key_p, const uint8_t *data_p,
+                                  VBW_TYPE *o, size_t ngroups, VBW_TYPE prev,
+                                  int delta) {
+  __m128i carry = _mm_set1_epi32(0);
+  if (delta)
+    carry = VBW_WIDTH == 32 ? _mm_set1_epi32(prev) : _mm_set1_epi16(prev);
+  for (size_t i = 0; i < ngroups; ++i) {
+    uint8_t k = key_p[i];
+    __m128i d = _mm_loadu_si128((const __m128i *)data_p);
+    __m128i s = _mm_load_si128((const __m128i *)VBW_NAME(_dec_shuf)[k]);
+    __m128i x = _mm_shuffle_epi8(d, s);
+    if (delta) {
+      // the group is scanned in registers, log-step as the 64-bit kernels
+#if VBW_WIDTH == 16
+      x = VBW_ADD(x, _mm_slli_si128(x, 2));
+#endif
+      x = VBW_ADD(x, _mm_slli_si128(x, 4));
+      x = VBW_ADD(x, _mm_slli_si128(x, 8));
+      x = VBW_ADD(x, carry);
+      carry = VBW_LAST(x);
+    }
+    _mm_storeu_si128((__m128i *)(o + i * VBW_GROUP), x);
+    data_p += VBW_NAME(_klen)[k];
+  }
+  return data_p;
+}
+
+__attribute__((target("ssse3"))) static const uint8_t *
+VBW_NAME(_dec_groups_ssse3)(const uint8_t *key_p, const uint8_t *data_p,
+                            VBW_TYPE *o, size_t ngroups, VBW_TYPE prev) {
+  return VBW_NAME(_dec_groups_ssse3_t)(key_p, data_p, o, ngroups, prev, 0);
+}
+
+__attribute__((target("ssse3"))) static const uint8_t *
+VBW_NAME(_dec_groups_delta_ssse3)(const uint8_t *key_p, const uint8_t *data_p,
+                                  VBW_TYPE *o, size_t ngroups, VBW_TYPE prev) {
+  return VBW_NAME(_dec_groups_ssse3_t)(key_p, data_p, o, ngroups, prev, 1);
+}
+#endif /* ifdef VBYTE64_X86 */
+
+static uint8_t *(*VBW_NAME(_enc_groups))(uint8_t *, uint8_t *,
+                                         const VBW_TYPE *, size_t,
+                                         VBW_TYPE) = VBW_NAME(_enc_groups_scalar);
+static uint8_t *(*VBW_NAME(_enc_groups_delta))(
+    uint8_t *, uint8_t *, const VBW_TYPE *, size_t,
+    VBW_TYPE) = VBW_NAME(_enc_groups_delta_scalar);
+static const uint8_t *(*VBW_NAME(_dec_groups))(
+    const uint8_t *, const uint8_t *, VBW_TYPE *, size_t,
+    VBW_TYPE) = VBW_NAME(_dec_groups_scalar);
+static const uint8_t *(*VBW_NAME(_dec_groups_delta))(
+    const uint8_t *, const uint8_t *, VBW_TYPE *, size_t,
+    VBW_TYPE) = VBW_NAME(_dec_groups_delta_scalar);
+
+__attribute__((constructor)) static void VBW_NAME(_init)(void) {
+  VBW_NAME(_tables_init)();
+}
+
+// called by `vb64_set_isa`, every level from SSSE3 up uses the same kernels
+static void VBW_NAME(_use_isa)(int isa) {
+  VBW_NAME(_enc_groups) = VBW_NAME(_enc_groups_scalar);
+  VBW_NAME(_enc_groups_delta) = VBW_NAME(_enc_groups_delta_scalar);
+  VBW_NAME(_dec_groups) = VBW_NAME(_dec_groups_scalar);
+  VBW_NAME(_dec_groups_delta) = VBW_NAME(_dec_groups_delta_scalar);
+#ifdef VBYTE64_X86
+  // the SIMD levels all include SSSE3, BMI2 is apart and does not imply it
+  if (isa == vb64_isa_ssse3 || isa == vb64_isa_avx2 ||
+      isa == vb64_isa_avx512 ||
+      (isa == vb64_isa_bmi2 && __builtin_cpu_supports("ssse3"))) {
+    VBW_NAME(_enc_groups) = VBW_NAME(_enc_groups_ssse3);
+    VBW_NAME(_enc_groups_delta) = VBW_NAME(_enc_groups_delta_ssse3);
+    VBW_NAME(_dec_groups) = VBW_NAME(_dec_groups_ssse3);
+    VBW_NAME(_dec_groups_delta) = VBW_NAME(_dec_groups_delta_ssse3);
+  }
+#else
+  (void)isa;
+#endif /* ifdef VBYTE64_X86 */
+}
+
+static uint8_t *VBW_NAME(_encode)(uint8_t *key_p, uint8_t *data_p,
+                                  const VBW_TYPE *v, size_t n, int delta) {
+  size_t ngroups = n / VBW_GROUP, i = ngroups * VBW_GROUP;
+  data_p = delta ? VBW_NAME(_enc_groups_delta)(key_p, data_p, v, ngroups, 0)
+                 : VBW_NAME(_enc_groups)(key_p, data_p, v, ngroups, 0);
+  if (i < n)
+    data_p = VBW_NAME(_enc_key)(key_p + ngroups, data_p, v + i, n - i,
+                                i ? v[i - 1] : 0, delta);
+  // pointer to first unused
+  return data_p;
+}
+
+// Number of leading full key bytes that the group kernels can decode without
+// over-reading the data, see `vb64_safe_pairs`.
+static inline size_t VBW_NAME(_safe_groups)(const uint8_t *key_p, size_t n) {
+  size_t ngroups = n / VBW_GROUP, m = n % VBW_GROUP;
+  size_t tail = m ? VBW_NAME(_plen)(key_p[ngroups], m) : 0;
+  while (ngroups && tail < 16)
+    tail += VBW_NAME(_klen)[key_p[--ngroups]];
+  return ngroups;
+}
+
+static const uint8_t *VBW_NAME(_decode)(const uint8_t *key_p,
+                                        const uint8_t *data_p, VBW_TYPE *o,
+                                        size_t n, int delta) {
+  size_t safe = VBW_NAME(_safe_groups)(key_p, n);
+  data_p = delta ? VBW_NAME(_dec_groups_delta)(key_p, data_p, o, safe, 0)
+                 : VBW_NAME(_dec_groups)(key_p, data_p, o, safe, 0);
+
+  // the last (less than 32) data bytes are copied to a local buffer, so that
+  // the kernels can over-read it freely
+  size_t ngroups = n / VBW_GROUP - safe, m = n % VBW_GROUP;
+  size_t i = (safe + ngroups) * VBW_GROUP, tail = 0;
+  for (size_t g = 0; g < ngroups; ++g)
+    tail += VBW_NAME(_klen)[key_p[safe + g]];
+  if (m)
+    tail += VBW_NAME(_plen)(key_p[safe + ngroups], m);
+
+  uint8_t buf[32 + 16] = {0};
+  memcpy(buf, data_p, tail);
+  VBW_TYPE prev = delta && safe ? o[safe * VBW_GROUP - 1] : 0;
+  const uint8_t *buf_p =
+      delta ? VBW_NAME(_dec_groups_delta)(key_p + safe, buf,
+                                          o + safe * VBW_GROUP, ngroups, prev)
+            : VBW_NAME(_dec_groups)(key_p + safe, buf, o + safe * VBW_GROUP,
+                                    ngroups, prev);
+  if (m) {
+    prev = delta && i ? o[i - 1] : 0;
+    VBW_NAME(_dec_key)(key_p[safe + ngroups], buf_p, o + i, m, prev, delta);
+  }
+  return data_p + tail;
+}
+
+static uint8_t *VBW_NAME(_compress_)(VBW_TYPE *v, size_t n, size_t *clen,
+                                     int wl, int delta) {
+  size_t head_size = wl ? sizeof(size_t) : 0;
+  size_t key_size = VBW_KEY_SIZE(n);
+  size_t compress_size = head_size + key_size +
+                         VBW_NAME(_encode_size)(v, n, delta) + VBYTE64_PADDING;
+
+  uint8_t *cdata = (uint8_t *)vb64_malloc(compress_size);
+  if (!cdata)
+    return NULL;
+  if (wl)
+    memcpy(cdata, &n, sizeof(size_t));
+  uint8_t *key_p = cdata + head_size;
+
+  uint8_t *data_p_end =
+      VBW_NAME(_encode)(key_p, key_p + key_size, v, n, delta);
+  if (clen)
+    *clen = data_p_end - cdata;
+  return cdata;
+}
+
+uint8_t *VBW_NAME(_compress)(VBW_TYPE *v, size_t n, size_t *clen) {
+  return VBW_NAME(_compress_)(v, n, clen, 0, 0);
+}
+
+uint8_t *VBW_NAME(_compress_delta)(VBW_TYPE *v, size_t n, size_t *clen) {
+  return VBW_NAME(_compress_)(v, n, clen, 0, 1);
+}
+
+uint8_t *VBW_NAME(_compress_wl)(VBW_TYPE *v, size_t n, size_t *clen) {
+  return VBW_NAME(_compress_)(v, n, clen, 1, 0);
+}
+
+uint8_t *VBW_NAME(_compress_delta_wl)(VBW_TYPE *v, size_t n, size_t *clen) {
+  return VBW_NAME(_compress_)(v, n, clen, 1, 1);
+}
+
+void VBW_NAME(_decompress)(uint8_t *in, VBW_TYPE *out, size_t n) {
+  VBW_NAME(_decode)(in, in + VBW_KEY_SIZE(n), out, n, 0);
+}
+
+void VBW_NAME(_decompress_delta)(uint8_t *in, VBW_TYPE *out, size_t n) {
+  VBW_NAME(_decode)(in, in + VBW_KEY_SIZE(n), out, n, 1);
+}
+
+static VBW_TYPE *VBW_NAME(_decompress_wl_)(uint8_t *in, size_t *n,
+                                           int delta) {
+  memcpy(n, in, sizeof(size_t));
+  VBW_TYPE *out = vb64_malloc(sizeof(out[0]) * *n);
+  if (!out)
+    return NULL;
+  uint8_t *key_p = in + sizeof(size_t);
+  VBW_NAME(_decode)(key_p, key_p + VBW_KEY_SIZE(*n), out, *n, delta);
+  return out;
+}
+
+VBW_TYPE *VBW_NAME(_decompress_wl)(uint8_t *in, size_t *n) {
+  return VBW_NAME(_decompress_wl_)(in, n, 0);
+}
+
+VBW_TYPE *VBW_NAME(_decompress_delta_wl)(uint8_t *in, size_t *n) {
+  return VBW_NAME(_decompress_wl_)(in, n, 1);
+}
+
+#undef VBW_LAST
+#undef VBW_SUB
+#undef VBW_ADD
+#undef VBW_KEY_SIZE
+#undef VBW_CMASK
+#undef VBW_GROUP
+#undef VBW_BYTES
+#undef VBW_NAME
+#undef VBW_CAT
+#undef VBW_CAT_
+#undef VBW_CODE_BITS
+#undef VBW_TYPE
+#undef VBW_WIDTH